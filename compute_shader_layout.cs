@@ -0,0 +1,158 @@
+#version 450 core
+
+// Lays out a string on the gpu, same as font_layout_run without kerning, tabs, markup
+// or alignment. It's a prefix sum over the chars of (newlines, glyphs, x), where x
+// starts over after each newline, done in three dispatches (see font_layout_gpu):
+//   pass 0: one workgroup per chunk of the string sums up its chunk into chunks[]
+//   pass 1: a single workgroup scans those sums, leaving what comes before each chunk
+//   pass 2: one workgroup per chunk scans it again and writes its glyphs
+
+#define CHUNK 256
+layout(local_size_x = CHUNK) in;
+
+layout(std430, binding = 0) readonly buffer Text   { uint text[];   }; // 4 chars per uint
+layout(std430, binding = 1) readonly buffer Colors { uint colors[]; }; // 4 color indices per uint
+#ifdef FONT_PACKED_INSTANCES
+layout(std430, binding = 2) writeonly buffer Glyphs { uvec2 glyphs[]; }; // (x | y << 16, glyph | color << 8)
+#else
+layout(std430, binding = 2) writeonly buffer Glyphs { vec4 glyphs[]; };  // (x, y, glyph, color)
+#endif
+// DrawArraysIndirectCommand, the number of glyphs is only known after pass 1
+layout(std430, binding = 3) writeonly buffer Command { uint count; uint instance_count; uint first; uint base_instance; };
+
+// a chunk's sum after pass 0, what comes before it after pass 1
+struct Chunk {
+    uint lines;
+    uint glyphs;
+    float x;
+    uint reset;     // a newline in there, x doesn't add up across it
+};
+layout(std430, binding = 7) buffer Chunks { Chunk chunks[]; };
+
+uniform int pass;
+uniform int len;
+uniform int has_colors;
+uniform int first_instance;
+uniform float height;
+uniform float glyph_widths[96];
+
+shared uint  s_lines[CHUNK];
+shared uint  s_glyphs[CHUNK];
+shared float s_x[CHUNK];
+shared bool  s_reset[CHUNK];  // a newline at or before this one, within the chunk
+
+uint byte_at(uint i, bool color)
+{
+    uint word = color ? colors[i >> 2] : text[i >> 2];
+    return (word >> ((i & 3u)*8u)) & 0xFFu;
+}
+
+// a then b
+Chunk combine(Chunk a, Chunk b)
+{
+    return Chunk(a.lines + b.lines, a.glyphs + b.glyphs, b.reset != 0u ? b.x : a.x + b.x, a.reset | b.reset);
+}
+
+// inclusive scan of the shared arrays, x is summed only up to the last newline
+void scan(uint t)
+{
+    barrier();
+    for (uint d = 1u; d < uint(CHUNK); d *= 2u) {
+        uint lines = s_lines[t];
+        uint emitted = s_glyphs[t];
+        float x = s_x[t];
+        bool reset = s_reset[t];
+        if (t >= d) {
+            lines += s_lines[t - d];
+            emitted += s_glyphs[t - d];
+            if (!reset)
+                x += s_x[t - d];
+            reset = reset || s_reset[t - d];
+        }
+        barrier();
+        s_lines[t] = lines;
+        s_glyphs[t] = emitted;
+        s_x[t] = x;
+        s_reset[t] = reset;
+        barrier();
+    }
+}
+
+Chunk scanned(uint t)
+{
+    return Chunk(s_lines[t], s_glyphs[t], s_x[t], s_reset[t] ? 1u : 0u);
+}
+
+void main()
+{
+    uint t = gl_LocalInvocationID.x;
+
+    if (pass == 1) {
+        // carried from one block of chunks to the next, only a handful of them
+        // unless the string is huge
+        uint num_chunks = (uint(len) + uint(CHUNK) - 1u)/uint(CHUNK);
+        Chunk carry = Chunk(0u, 0u, 0.0, 0u);
+        for (uint block = 0u; block < num_chunks; block += uint(CHUNK)) {
+            uint k = block + t;
+            Chunk c = k < num_chunks ? chunks[k] : Chunk(0u, 0u, 0.0, 0u);
+            s_lines[t] = c.lines;
+            s_glyphs[t] = c.glyphs;
+            s_x[t] = c.x;
+            s_reset[t] = c.reset != 0u;
+            scan(t);
+
+            if (k < num_chunks)
+                chunks[k] = t == 0u ? carry : combine(carry, scanned(t - 1u));
+            carry = combine(carry, scanned(uint(CHUNK) - 1u));
+            barrier();
+        }
+
+        if (t == 0u) {
+            count = 6u;
+            instance_count = carry.glyphs;
+            first = 0u;
+            base_instance = uint(first_instance);
+        }
+        return;
+    }
+
+    uint chunk = gl_WorkGroupID.x;
+    uint i = chunk*uint(CHUNK) + t;
+    uint c = i < uint(len) ? byte_at(i, false) : 0u;
+
+    // control chars never emit a glyph, newlines start a new line
+    bool newline = c == 10u;
+    bool emit = c >= 32u && c < 128u;
+#ifdef FONT_MONOSPACE
+    float width = emit ? 1.0 : 0.0;
+#else
+    float width = emit ? glyph_widths[c - 32u] : 0.0;
+#endif
+    s_lines[t] = newline ? 1u : 0u;
+    s_glyphs[t] = emit ? 1u : 0u;
+    s_x[t] = width;
+    s_reset[t] = newline;
+    scan(t);
+
+    if (pass == 0) {
+        if (t == uint(CHUNK) - 1u)
+            chunks[chunk] = scanned(t);
+        return;
+    }
+
+    if (emit) {
+        Chunk before = chunks[chunk];
+        float x = s_x[t] - width + (s_reset[t] ? 0.0 : before.x);
+        float y = -float(before.lines + s_lines[t])*height;
+        uint g = uint(first_instance) + before.glyphs + s_glyphs[t] - 1u;
+        uint color = has_colors != 0 ? byte_at(i, true) : 0u;
+#ifdef FONT_PACKED_INSTANCES
+        // y is the row here. unlike font_layout_run this can't refuse the string, so it clamps
+        x = min(x, 32767.0);
+        y = max(y, -32767.0);
+        glyphs[g] = uvec2((uint(int(x)) & 0xFFFFu) | (uint(int(y)) << 16), (c - 32u) | (color << 8));
+#else
+        glyphs[g] = vec4(x, y, float(c - 32u), float(color));
+#endif
+    }
+}
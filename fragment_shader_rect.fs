@@ -0,0 +1,13 @@
+#version 450 core
+
+in float color_index;
+
+// palette 0 of the palettes the text draws with
+layout(std140, binding = 0) uniform Font_Colors { vec4 palettes[9]; };
+
+out vec4 color;
+
+void main()
+{
+    color = vec4(palettes[int(color_index+0.5)].rgb, 1.0);
+}
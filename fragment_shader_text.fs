@@ -4,9 +4,10 @@ in vec2 uv;
 in float color_index;
 
 layout(binding = 0) uniform sampler2D sampler_font;
-uniform vec3 colors[9];
+// every palette, updated only when they change. color_index includes the palette (9*palette + color)
+layout(std140, binding = 0) uniform Font_Colors { vec4 palettes[9*FONT_MAX_PALETTES]; };
 
-out vec3 color;
+out vec4 color;
 
 void main()
 {
@@ -15,6 +16,7 @@ void main()
 
     float s = smoothstep(0.4, 0.6, texture(sampler_font, uv2).r);
     
-    vec3 col = colors[int(color_index+0.5)];
-    color = colors[8]*s + col*(1.0 - s);
+    // blended over whatever is behind the glyph (clear color or highlights)
+    vec3 col = palettes[int(color_index+0.5)].rgb;
+    color = vec4(col, 1.0 - s);
 }
@@ -7,25 +7,326 @@ extern "C" {
 // utility functions to load shaders
 char *readFile2(const char *filename);
 GLuint LoadShaders2(const char * vertex_file_path,const char * fragment_file_path);
+GLuint LoadShadersDefines2(const char * vertex_file_path,const char * fragment_file_path, const char *defines);
+GLuint LoadComputeShaderDefines2(const char * compute_file_path, const char *defines);
 
-#define MAX_STRING_LEN 40000
+#define MAX_STRING_LEN 40000 // initial glyph capacity, grows as needed
 #define NUM_GLYPHS 96
+#define FONT_MAX_TAB_STOPS 32
+#define FONT_MAX_TAB_COLUMNS 64
+
+// inline markup: FONT_ESC followed by '0'-'8' switches to that palette color, 
+// FONT_ESC followed by 'A', 'B', ... to that palette (of FONT_MAX_PALETTES), 
+// and FONT_ESC 'r' back to color 0 of palette 'A'. Only with font_set_markup(1)
+#define FONT_ESC "\x1b"
+#define FONT_ESC_CHAR '\x1b'
+
+// how glyph instances get to the gpu can be picked at runtime, see Font_Stream.
+// by default they're written straight into a persistently mapped ring of 
+// FONT_RING_REGIONS times font.capacity glyphs, each frame's part of it is fenced.
+// define FONT_NO_DSA_VBO to start out with glBufferSubData from a malloc'ed copy instead
+#define FONT_RING_REGIONS 3
+#define FONT_RING_FRAMES 8      // fenced frames the ring keeps track of
+
+// atlas updates are staged through this many pbos, see font_atlas_update
+#define FONT_ATLAS_PBOS 3
+
+// glyphs in the arena buffer at first, it doubles when full. It's compacted when 
+// less than FONT_ARENA_COMPACT of the free glyphs are in the largest free range
+#define FONT_ARENA_INITIAL 65536
+#define FONT_ARENA_COMPACT 0.5
+
+// batched strings pick one of FONT_MAX_PALETTES palettes of 9 colors, see font_set_palette.
+// a batch holds up to FONT_MAX_BATCH_STRINGS strings, since glyphs store their string in 16 bits
+#define FONT_MAX_PALETTES 8
+#define FONT_MAX_BATCH_STRINGS 65536
+
+// with FONT_STREAM_SUBDATA, glyphs are compared to the last upload FONT_DIFF_BLOCK at a time,
+// and only changed blocks are uploaded, in at most FONT_MAX_UPLOAD_RANGES calls
+#define FONT_DIFF_BLOCK 16
+#define FONT_MAX_UPLOAD_RANGES 8
+
+// gpu layout works on chunks of this many chars, one workgroup each, CHUNK in compute_shader_layout.cs.
+// GL only promises 65535 workgroups per dispatch, longer strings are laid out on the cpu
+#define FONT_LAYOUT_CHUNK 256
+#define FONT_LAYOUT_MAX_CHARS (FONT_LAYOUT_CHUNK*65535)
 /*
     The font stores all the glyphs sequentially, 
     so the texture is "size of font" high, and
     sum(glyph_widths) wide
 
-    one string can hold up to MAX_STRING_LEN chars, which is hard coded to 40k...
+    the glyph storage starts out with room for MAX_STRING_LEN (40k) glyphs, and 
+    doubles whenever a longer string comes along (see font_reserve).
     there's really no need to have multiple vbos for multiple strings, because
-    it's so damn fast anyway. 40k is the max used storage, buy usually you'll just
-    use the first 100 or so chars
+    it's so damn fast anyway. usually you'll just use the first 100 or so chars
 
     uses instancing, so that the only thing that need to be updated is the
     position of each glyph in the string (relative to the lower left corner)
     and its index for lookup in the metadata texture
 
     the metadata texture values are then used to look up in the bitmap texture
+
+    #define FONT_MONOSPACE before including this file for fonts where every glyph 
+    is as wide as ' '. Glyph positions are then stored as (column, row) and scaled 
+    in the vertex shader, and layout never looks up glyph widths or kerning
+*/
+
+/*
+    One glyph instance. By default 4 floats (x, y, glyph index, color index), 
+    16 bytes per glyph. With FONT_PACKED_INSTANCES defined it's 8 bytes: 
+    x is whole pixels (columns with FONT_MONOSPACE) and y is the row, both 
+    relative to the string origin, and the vertex shader scales the row by the 
+    line height. Both have to fit in FONT_PACKED_MAX, font_layout_end refuses 
+    (draws nothing for) a string that is taller or wider than that
+*/
+#ifdef FONT_PACKED_INSTANCES
+#define FONT_PACKED_MAX 32767   // most rows, and widest line in pixels, of a packed layout
+typedef struct Font_Glyph {
+    short x, y;
+    unsigned char glyph;
+    unsigned char color;
+    unsigned short flags;   // the string in a batch, unused otherwise
+} Font_Glyph;
+#else
+typedef struct Font_Glyph {
+    float x, y;
+    float glyph;
+    float color;            // in a batch + 256*string, which is still exact
+} Font_Glyph;
+#endif
+
+// ways of getting the glyphs of a layout into vbo_code_instances, see font_set_stream
+typedef enum Font_Stream {
+    FONT_STREAM_SUBDATA = 0,      // glBufferSubData of the blocks that changed, see font_upload_diff
+    FONT_STREAM_ORPHAN,           // glBufferData(NULL) for fresh storage, then glBufferSubData
+    FONT_STREAM_MAP_UNSYNC,       // unsynchronized glMapBufferRange of space not used yet, orphaned when full
+    FONT_STREAM_PERSISTENT,       // fenced ring, persistently mapped and coherent, layout writes into it
+    FONT_STREAM_PERSISTENT_FLUSH, // same, but not coherent, what layout wrote is flushed explicitly
+    FONT_STREAM_COUNT
+} Font_Stream;
+
+/*
+    Hit testing index, built during layout: where each line starts (in glyphs 
+    and in chars), and which char each glyph came from. The glyph x positions 
+    are increasing within a line, so they serve as the prefix sums of the 
+    glyph widths, and a point is found with a binary search in its line
+*/
+typedef struct Font_Text_Index {
+    int num_lines;
+    int max_lines;
+    int *line_glyphs;   // first glyph of each line
+    int *line_chars;    // offset of the first char of each line
+    int *glyph_chars;   // offset of the char of each glyph
+} Font_Text_Index;
+
+/*
+    One buffer of glyph instances shared by any number of resident strings, which
+    each get a range of it, so there's no vbo per string and everything can be drawn 
+    from one buffer. Free ranges are kept sorted by offset and merged with their
+    neighbours, allocation is first fit. Ranges are referred to by handle, since 
+    compaction moves them
+*/
+typedef struct Font_Arena_Range {
+    int offset;         // first glyph in the arena, -1 for a free handle
+    int size;           // glyphs reserved
+    int count;          // glyphs uploaded, at most size
+} Font_Arena_Range;
+
+typedef struct Font_Arena {
+    GLuint vbo;
+    int capacity;               // glyphs
+    int used;                   // glyphs in live ranges
+
+    Font_Arena_Range *ranges;   // indexed by handle
+    int num_ranges;
+    int max_ranges;
+    int *free_handles;
+    int num_free_handles;
+
+    Font_Arena_Range *free;     // free ranges (offset, size), sorted by offset
+    int num_free;
+    int max_free;
+    int compactions;            // bumped whenever ranges move
+} Font_Arena;
+
+/*
+    Where and how a batched string is drawn, as read by the vertex shader (std430).
+    offset and size come first, so a string is moved by rewriting 16 bytes
+*/
+typedef struct Font_String_Params {
+    float offset[2];        // string_offset, in NDC
+    float size[2];          // string_size
+    float clip[4];          // (x0, y0, x1, y1) in NDC, anything outside is cut off
+    float resolution[2];
+    int palette;            // < FONT_MAX_PALETTES
+    float z;                // gl_Position.z, for layering against depth tested geometry
+} Font_String_Params;
+
+// tab stops, see font_set_tabs
+typedef struct Font_Tabs {
+    int width;                  // between regular stops in pixels, 0 for 4 spaces
+    int num_stops;
+    int stops[FONT_MAX_TAB_STOPS];
+} Font_Tabs;
+
+/*
+    Everything layout reads that can be changed between strings. Taken from the
+    font when a layout begins, or kept per context so workers never read the globals
+*/
+typedef struct Font_Layout_Options {
+    int align;                  // Font_Align
+    int align_width;
+    int markup;
+    int kerning;                // use the font's kerning table
+    int tab_elastic;
+    Font_Tabs tabs;
+} Font_Layout_Options;
+
+typedef enum Font_Command_Kind {
+    FONT_COMMAND_RECTS,         // highlights, sorted under the text of their layer
+    FONT_COMMAND_TEXT,
+} Font_Command_Kind;
+
+/*
+    One recorded draw. Commands are drawn in the order of their key,
+    layer << 48 | kind << 40 | sequence, so layers are drawn bottom up whatever
+    order they were recorded in, and within a layer the commands that share
+    a program end up next to each other, in the order they were recorded
+*/
+typedef struct Font_Command {
+    unsigned long long key;
+    int first;                  // text: first glyph in the batch
+    int count;                  // text: glyphs
+    int string;                 // text: index into the params
+    struct Font_Highlights *highlights;
+    float placement[6];         // rects: offset, size, res
+} Font_Command;
+
+/*
+    Laid out strings and commands waiting to be drawn. The batch records into 
+    one, and any thread can record into its own with font_context_draw, since
+    laying out only reads the glyphs and options. The buffers only grow, and are reused
+    after each font_context_submit
+*/
+typedef struct Font_Context {
+    Font_Glyph *glyphs;         // in the order recorded, not yet tagged
+    int num_glyphs;
+    int max_glyphs;
+    Font_String_Params *params;
+    int num_strings;
+    int max_strings;
+    Font_Command *commands;
+    int num_commands;
+    int max_commands;
+    unsigned char *tab_cells;   // for elastic tabs
+    int max_tab_cells;
+
+    // layer and layout options of the strings recorded from now on
+    int layer;
+    Font_Layout_Options options;
+} Font_Context;
+
+// glyphs [first, end) of the ring, written in one frame and drawn before fence
+typedef struct Font_Ring_Frame {
+    int first, end;
+    GLsync fence;
+} Font_Ring_Frame;
+
+/*
+    With batching on, font_draw only lays out into here, and font_flush sorts the 
+    commands, uploads all the strings at once and draws each run of text commands 
+    with a single instanced draw. Every glyph is tagged with its string 
+    (see Font_Glyph), which indexes the params
+*/
+typedef struct Font_Batch {
+    int enabled;
+    Font_Context context;       // font_draw and font_context_submit record into this
+
+    // glyphs and params in key order, as uploaded
+    Font_Glyph *sorted;
+    int max_sorted;
+    Font_String_Params *sorted_params;
+    int max_sorted_params;
+
+    GLuint vbo;
+    GLuint ssbo_params;
+} Font_Batch;
+
+/*
+    Retained strings, see text_create. The glyphs stay in an arena range until the
+    string changes, tagged with their text like a batch, and the params live in an 
+    ssbo indexed by text, so moving or recoloring only rewrites those
+*/
+typedef struct Font_Texts {
+    Font_String_Params *params;
+    int *handles;               // arena handle of each text, -1 when destroyed
+    unsigned char *alive;       // between text_create and text_destroy
+    int num_texts;
+    int max_texts;
+    int *free_ids;
+    int num_free_ids;
+
+    GLuint ssbo_params;         // max_texts long
+    int ssbo_texts;             // texts the ssbo was made for
+
+    // one DrawArraysIndirectCommand per live text, rebuilt when ranges change
+    GLuint buffer_commands;
+    int num_commands;
+    int commands_dirty;
+    int compactions;            // font.arena.compactions when they were built
+
+    Font_Glyph *scratch;        // layout space for text_set_string
+    int max_scratch;
+    unsigned char *tab_cells;   // for elastic tabs, max_scratch long
+} Font_Texts;
+
+/*
+    Uniform locations of one program, looked up once after linking. The
+    placement and pull uniforms are also kept as last uploaded, to skip uploading them again
 */
+typedef struct Font_Uniforms {
+    GLint string_offset;
+    GLint string_size;
+    GLint resolution;
+    GLint line_height;          // rect program
+    GLint len;                  // layout program
+    GLint first_instance;       // layout program
+    GLint has_colors;           // layout and pull programs
+    GLint height;               // layout and pull programs
+    GLint num_lines;            // pull program
+    GLint pass;                 // layout program
+    float placement[6];         // string_offset, string_size, resolution
+    int placement_valid;
+    int pull[2];                // num_lines, has_colors
+    float pull_height;
+    int pull_valid;
+} Font_Uniforms;
+
+/*
+    GL state as last set by the font code, so binds that wouldn't change anything
+    can be skipped. Anything else that touches this state has to call font_invalidate_state
+*/
+typedef struct Font_State {
+    GLuint program;
+    GLuint vao;
+    GLuint textures[2];
+    GLuint ubo_colors;
+    int blend;                  // -1 unknown
+} Font_State;
+
+// calls made (and skipped) by the draw path, see font_get_stats
+typedef struct Font_Stats {
+    int draw_calls;             // draws and compute dispatches
+    int program_binds;
+    int texture_binds;
+    int vao_binds;
+    int blend_changes;
+    int uniform_uploads;        // glUniform* and ubo updates
+    int uniform_lookups;        // glGetUniformLocation
+    int skipped;                // redundant binds and uploads not issued
+    int storage_grows;          // font_reserve grew the glyph storage, to font.capacity
+} Font_Stats;
+
 typedef struct Font {
     int initialized;
     // font info and data
@@ -36,10 +337,51 @@ typedef struct Font {
     int glyph_widths[NUM_GLYPHS];  // variable width of each glyph
     int glyph_offsets[NUM_GLYPHS]; // starting point of each glyph
 
+    // optional pair kerning in pixels, indexed by [previous glyph][current glyph]
+    // dense 96x96 bytes (9 KiB), small enough to stay in cache during layout
+    int kerning_enabled;
+    signed char kerning[NUM_GLYPHS][NUM_GLYPHS];
+
+    // horizontal alignment of each line, relative to x = 0 in string space
+    // align_width is the line width used by FONT_ALIGN_JUSTIFY
+    int align;
+    int align_width;
+
+    // tabs advance to the next stop without emitting a glyph. explicit stops (in pixels, 
+    // increasing) come first, then a stop every tabs.width pixels (0 means 4 spaces).
+    // with tab_elastic set, tab separated cells instead form columns as wide as 
+    // their widest cell in the string, plus the width of a space. a line with more
+    // than FONT_MAX_TAB_COLUMNS cells goes back to the stops within its last column
+    Font_Tabs tabs;
+    int tab_elastic;
+    unsigned char *tab_cells;   // scratch, column index of each glyph in elastic mode
+
+    // strip inline color markup (FONT_ESC) instead of using a color array
+    int markup_enabled;
+
+    // with hit_index_enabled, font_layout builds index for font_hit_test
+    int hit_index_enabled;
+    Font_Text_Index index;
+
     // opengl stuff
     GLuint vao; 
 
     GLuint program;
+    GLuint program_rect;        // highlight rectangles
+    GLuint program_layout;      // compute shader for font_set_gpu_layout
+    GLuint program_pull;        // text program without instance data, for font_set_vertex_pulling
+    GLuint program_batch;       // text program that places glyphs by their string's params, for font_flush
+    Font_Uniforms uniforms;     // of program, and so on
+    Font_Uniforms uniforms_rect;
+    Font_Uniforms uniforms_layout;
+    Font_Uniforms uniforms_pull;
+    Font_Uniforms uniforms_batch;
+    Font_State state;
+    Font_Stats stats;
+
+    // all palettes as std140 vec4s, palette 0 is colors. uploaded when they changed
+    GLuint ubo_colors;
+    int colors_dirty;
     
     // vbo used for glyph instancing, it's just [0,1]x[0,1]
     GLuint vbo_glyph_pos_instance;
@@ -47,20 +389,208 @@ typedef struct Font {
     // 2D texture for bitmap data
     GLuint texture_fontdata;
 
+    // cpu copy of the bitmap, in texture space (rows bottom up, width_padded wide).
+    // changes are collected in a dirty rect and uploaded through a ring of pbos
+    unsigned char *atlas_pixels;
+    int atlas_dirty;
+    int atlas_x0, atlas_y0, atlas_x1, atlas_y1;
+    GLuint atlas_pbo;
+    unsigned char *atlas_pbo_data;  // persistently mapped, FONT_ATLAS_PBOS slots of a whole atlas each
+    int atlas_slot;
+    GLsync atlas_fences[FONT_ATLAS_PBOS];
+
     // 1D texture for glyph metadata, RGBA: (glyph_offset_x, glyph_offset_y, glyph_width, glyph_height)
     // normalized (since it's a texture)
     GLuint texture_metadata;
 
     GLuint vbo_code_instances;  // vec3: (char_pos_x, char_pos_y, char_index)
     
-    float *text_glyph_data;
+    Font_Glyph *text_glyph_data; // glyphs of the last layout, in the ring (write only) or in staging
+    Font_Stream stream;
+    Font_Glyph *staging;         // layout writes here for the streams that copy into the vbo
+    int capacity;                // max glyphs in one layout, i.e. size of a ring region
+    int high_water;              // most glyphs in one layout so far
+    int first_instance;          // offset of text_glyph_data in vbo_code_instances
+
+    // persistent mapped ring, see font_ring_reserve
+    Font_Glyph *ring;
+    int ring_head;               // next free glyph
+    int ring_frame_start;        // first glyph written in this frame
+    Font_Ring_Frame ring_frames[FONT_RING_FRAMES]; // fenced frames, oldest first
+    int ring_num_frames;
+
+    // copy of what's in vbo_code_instances with FONT_STREAM_SUBDATA, see font_upload_diff
+    Font_Glyph *shadow;
+    int shadow_len;
+    long long upload_bytes;       // bytes actually uploaded
+    long long upload_bytes_saved; // bytes skipped since they didn't change
+
+    // gpu layout, see font_set_gpu_layout
+    int gpu_layout_enabled;
+    int gpu_layout;               // the last layout only exists on the gpu, and is drawn indirectly
+    GLuint ssbo_text;             // raw chars of the string, font.capacity bytes
+    GLuint ssbo_colors;           // color index per char
+    GLuint buffer_command;        // DrawArraysIndirectCommand, written by the compute shader
+    GLuint ssbo_chunks;           // what comes before each chunk of the string, between the passes
+
+    // vertex pulling, see font_set_vertex_pulling
+    int vertex_pulling_enabled;
+    int pulled;                   // the last layout is drawn straight from ssbo_text
+    int pull_len;
+    int pull_lines;
+    int pull_colors;              // col was given
+    int *line_starts;             // first char of each line, font.capacity+1 of them
+    GLuint ssbo_lines;
+    float *pull_x;                // x of each char from the start of its line, font.capacity of them
+    GLuint ssbo_pull_x;           // unused with FONT_MONOSPACE, where x is the column
+
+    Font_Arena arena;           // resident strings, see font_arena_alloc
+    Font_Batch batch;           // strings waiting for font_flush
+    Font_Texts texts;           // retained strings, see text_create
+    float palettes[FONT_MAX_PALETTES][9*3];
     
     int ctr;                    // the number of glyphs to draw (i.e. the length of the string minus newlines)
 } Font;
 
+typedef enum Font_Align {
+    FONT_ALIGN_LEFT = 0, // lines start at x = 0
+    FONT_ALIGN_RIGHT,    // lines end at x = 0
+    FONT_ALIGN_CENTER,   // lines are centered on x = 0
+    FONT_ALIGN_JUSTIFY   // lines span [0, align_width], spaces are stretched. the last line is left aligned
+} Font_Align;
+
+// a string that doesn't have to be null terminated, for batched measurement
+typedef struct Font_String_View {
+    const char *str;
+    int len;            // number of chars, or -1 if null terminated
+    unsigned int hash;  // identifies the contents for memoization, 0 to always measure
+} Font_String_View;
+
+// running state of the layout loop, so a string can be laid out in several pieces
+typedef struct Font_Layout_State {
+    float X, Y;
+    int ctr;            // number of glyphs written so far
+    int prev;           // previous glyph for kerning, -1 at the start of a line
+    int line_start;     // first glyph of the current line
+    int align;          // Font_Align, taken from the options when layout begins
+    int align_width;
+    int elastic;        // elastic tabs
+    int markup;         // parse FONT_ESC color markup
+    int kerning;        // use the kerning table
+    Font_Tabs tabs;
+    int color;          // current markup color
+    int cell;           // elastic tab column of the current cell
+    int col_width[FONT_MAX_TAB_COLUMNS];
+
+    // bounds, collected on the way
+    float max_width;    // widest finished line, not used in elastic mode
+    int lines;          // finished lines
+    int line_open;      // nonzero if the current line has any chars
+    float trailing[FONT_MAX_TAB_COLUMNS]; // elastic mode: widest last cell of a line per column, -1 if none
+
+    Font_Text_Index *index;     // built on the way if not NULL
+    int overflow;       // packed glyphs only: a position didn't fit FONT_PACKED_MAX
+} Font_Layout_State;
+
+// what font_layout measured on the way
+typedef struct Font_Bounds {
+    int width;          // widest line in pixels
+    int height;         // lines*font.height in pixels
+    int lines;
+    int glyphs;         // number of glyph instances
+} Font_Bounds;
+
+// a large string laid out a few lines per frame, see font_job_step
+typedef struct Font_Layout_Job {
+    const char *str;
+    const char *col;
+    int len;
+    int cursor;                 // next char to lay out
+    int done;
+    Font_Layout_State state;
+
+    Font_Glyph *glyph_data;     // room for len glyphs
+    unsigned char *tab_cells;   // only in elastic mode
+    Font_Text_Index index;      // only if the font had hit_index_enabled at font_job_begin
+    int uploaded;               // number of glyphs in vbo
+    GLuint vbo;
+} Font_Layout_Job;
+
+// rectangles (selections, search matches, caret lines) drawn behind text, in one instanced draw
+typedef struct Font_Highlights {
+    float *rects;       // 4 floats per rect: (x, y, width, color index) in string space pixels
+    int count;
+    int capacity;
+    int uploaded;       // rects [0, uploaded) are already in vbo
+    int vbo_capacity;
+    GLuint vbo;
+} Font_Highlights;
+
 
 void font_init();
+int font_load_kerning(const char *filename);
+void font_set_kerning(int enabled);
+void font_set_align(Font_Align align, int align_width);
+void font_job_begin(Font_Layout_Job *job, char *str, char *col);
+int  font_job_step(Font_Layout_Job *job, double budget_us);
+void font_job_draw(Font_Layout_Job *job, float offset[2], float size[2], float res[2]);
+void font_job_end(Font_Layout_Job *job);
+void font_set_tabs(int tab_width, const int *stops, int num_stops, int elastic);
+void font_string_dimensions(char *str, int *width, int *height);
+void font_measure_strings(const Font_String_View *strings, int num_strings, int *widths, int *heights);
+float font_benchmark_kerning(char *str, int iterations);
 void font_draw(char *str, char *col, float offset[2], float size[2], float res[2]);
+void font_set_batching(int enabled);
+void font_set_layer(int layer);
+void font_flush();
+void font_params_init(Font_String_Params *params, float offset[2], float size[2], float res[2]);
+void font_draw_params(char *str, char *col, const Font_String_Params *params);
+void font_set_palette(int palette, const float *rgb);
+void font_invalidate_state();
+void font_get_stats(Font_Stats *stats);
+void font_reset_stats();
+void font_layout(char *str, char *col, Font_Bounds *bounds);
+void font_draw_layout(float offset[2], float size[2], float res[2]);
+void font_set_hit_index(int enabled);
+void font_reserve(int max_glyphs);
+int  font_high_water_mark();
+void font_set_markup(int enabled);
+void font_set_gpu_layout(int enabled);
+void font_set_vertex_pulling(int enabled);
+void font_set_stream(Font_Stream stream);
+Font_Stream font_benchmark_streams(char *str, int iterations);
+void font_atlas_update(int x, int y, int w, int h, const unsigned char *pixels);
+int  font_arena_alloc(int num_glyphs);
+void font_arena_upload(int handle, const Font_Glyph *glyphs, int num_glyphs);
+void font_arena_free(int handle);
+void font_arena_compact();
+float font_arena_fragmentation();
+void font_arena_draw(int handle, float offset[2], float size[2], float res[2]);
+int  text_create(char *str, char *col, const Font_String_Params *params);
+void text_set_string(int text, char *str, char *col);
+void text_set_transform(int text, float offset[2], float size[2]);
+void text_set_palette(int text, int palette);
+void text_set_params(int text, const Font_String_Params *params);
+void text_destroy(int text);
+void text_draw_all();
+int  font_atlas_flush();
+int  font_hit_test(double x, double y, float offset[2], float size[2], float res[2]);
+int  font_job_hit_test(Font_Layout_Job *job, double x, double y, float offset[2], float size[2], float res[2]);
+void font_highlights_add(Font_Highlights *h, int begin, int end, int color);
+void font_job_highlights_add(Font_Layout_Job *job, Font_Highlights *h, int begin, int end, int color);
+void font_highlights_clear(Font_Highlights *h);
+void font_highlights_draw(Font_Highlights *h, float offset[2], float size[2], float res[2]);
+void font_highlights_submit(Font_Highlights *h, float offset[2], float size[2], float res[2]);
+void font_context_init(Font_Context *ctx);
+void font_context_set_layer(Font_Context *ctx, int layer);
+void font_context_set_align(Font_Context *ctx, Font_Align align, int align_width);
+void font_context_set_markup(Font_Context *ctx, int enabled);
+void font_context_set_tabs(Font_Context *ctx, int tab_width, const int *stops, int num_stops, int elastic);
+void font_context_set_kerning(Font_Context *ctx, int enabled);
+void font_context_draw(Font_Context *ctx, char *str, char *col, const Font_String_Params *params);
+void font_context_submit(Font_Context *ctx);
+void font_context_free(Font_Context *ctx);
+void font_highlights_free(Font_Highlights *h);
 Font *font_get_font();
 float *get_colors(int *num_colors);
 
@@ -73,6 +603,8 @@ float *get_colors(int *num_colors);
 
 #ifdef DRAW_FONT_IMPLEMENTATION
 
+#include <assert.h>
+
 #define STB_IMAGE_IMPLEMENTATION
 #define STBI_ONLY_PNG
 #include "stb_image.h"
@@ -89,280 +621,3083 @@ float colors[9*3] = {
      39/255.0,  40/255.0,  34/255.0  // clear color
 };
 
+Font font = {0};
+
+// the colors can be changed through the returned pointer, so they're uploaded again
 float *get_colors(int *num_colors)
 {
     *num_colors = sizeof(colors)/sizeof(float)/3;
+    font.colors_dirty = 1;
     return colors;
 }
 
-Font font = {0};
+// layout units in pixels, i.e. the size of one column in monospace mode
+#ifdef FONT_MONOSPACE
+#define FONT_UNIT ((float)font.glyph_widths[0])
+#else
+#define FONT_UNIT 1.0f
+#endif
+
+/*
+    Width in pixels of a single line of n printable chars (no newlines or other control chars)
+
+    The unkerned path uses four independent accumulators, so the adds don't
+    serialize on a single register and the compiler is free to vectorize
+*/
+static int font_line_width(const char *s, int n)
+{
+#ifdef FONT_MONOSPACE
+    (void)s;
+    return n*font.glyph_widths[0];
+#endif
+    int *glyph_widths = font.glyph_widths;
+
+    if (font.kerning_enabled) {
+        int width = 0;
+        int prev = -1;
+        for (int i = 0; i < n; i++) {
+            int code = s[i]-32;
+            if (prev >= 0)
+                width += font.kerning[prev][code];
+            width += glyph_widths[code];
+            prev = code;
+        }
+        return width;
+    }
+
+    int w0 = 0, w1 = 0, w2 = 0, w3 = 0;
+    int i = 0;
+    for (; i+4 <= n; i += 4) {
+        w0 += glyph_widths[s[i+0]-32];
+        w1 += glyph_widths[s[i+1]-32];
+        w2 += glyph_widths[s[i+2]-32];
+        w3 += glyph_widths[s[i+3]-32];
+    }
+    for (; i < n; i++) {
+        w0 += glyph_widths[s[i]-32];
+    }
+
+    return w0 + w1 + w2 + w3;
+}
+
+// position of the first tab stop after X
+static float font_next_tab_stop(const Font_Tabs *tabs, float X)
+{
+    for (int k = 0; k < tabs->num_stops; k++) {
+        if (tabs->stops[k] > X)
+            return tabs->stops[k];
+    }
+
+    int tab_width = tabs->width > 0 ? tabs->width : 4*font.glyph_widths[0];
+    int last = tabs->num_stops > 0 ? tabs->stops[tabs->num_stops-1] : 0;
+
+    return last + (floorf((X - last)/tab_width) + 1.0f)*tab_width;
+}
+
+// slow path of font_line_width for lines that contain tabs or other control chars
+static int font_line_width_tabs(const char *s, int n)
+{
+#ifdef FONT_MONOSPACE
+    // every glyph is as wide as ' ', and there's no kerning, same as the layout
+    signed char (*kerning)[NUM_GLYPHS] = NULL;
+#else
+    signed char (*kerning)[NUM_GLYPHS] = font.kerning_enabled ? font.kerning : NULL;
+#endif
+    int prev = -1;
+
+    float X = 0.0;
+    for (int i = 0; i < n; i++) {
+        if ((unsigned char)s[i] < 32) {
+            if (s[i] == FONT_ESC_CHAR && font.markup_enabled) {
+                i++; // markup takes no space
+                continue;
+            }
+            if (s[i] == '\t')
+                X = font_next_tab_stop(&font.tabs, X);
+            prev = -1;
+            continue;
+        }
+
+        int code = s[i]-32;
+        if (kerning && prev >= 0)
+            X += kerning[prev][code];
+#ifdef FONT_MONOSPACE
+        X += font.glyph_widths[0];
+#else
+        X += font.glyph_widths[code];
+#endif
+        prev = code;
+    }
+
+    return (int)X;
+}
+
+/*
+    Elastic tabs: the columns are only known after the whole string is seen, 
+    so keep the widest tab terminated cell of each column, and the widest 
+    trailing cell (ending at a newline) that starts in each column. 
+    The widest line then ends at max(column start + trailing cell)
+*/
+// whether the layout counts a last line of n chars, markup alone doesn't make a line
+static int font_line_is_open(const char *s, int n)
+{
+    for (int i = 0; i < n; i++) {
+        if (s[i] == FONT_ESC_CHAR && font.markup_enabled && i+1 < n) {
+            i++;
+            continue;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+static void font_measure_elastic(const char *str, int len, int *width, int *lines)
+{
+    int col_width[FONT_MAX_TAB_COLUMNS] = {0};
+    int trailing[FONT_MAX_TAB_COLUMNS];
+    for (int c = 0; c < FONT_MAX_TAB_COLUMNS; c++) {
+        trailing[c] = -1; // no line ends in this column
+    }
+
+#ifdef FONT_MONOSPACE
+    signed char (*kerning)[NUM_GLYPHS] = NULL;
+#else
+    signed char (*kerning)[NUM_GLYPHS] = font.kerning_enabled ? font.kerning : NULL;
+#endif
+    int prev = -1;
+
+    int X = 0;
+    int cell = 0;
+    int num_lines = 0;
+    for (int i = 0; i < len; i++) {
+        if ((unsigned char)str[i] < 32) {
+            if (str[i] == FONT_ESC_CHAR && font.markup_enabled && i+1 < len && str[i+1] != '\n') {
+                i++;
+                continue;
+            }
+            if (str[i] == '\n') {
+                if (X > trailing[cell])
+                    trailing[cell] = X;
+                cell = 0;
+                X = 0;
+                num_lines++;
+            } else if (str[i] == '\t') {
+                if (cell < FONT_MAX_TAB_COLUMNS-1) {
+                    if (X > col_width[cell])
+                        col_width[cell] = X;
+                    cell++;
+                    X = 0;
+                } else {
+                    X = (int)font_next_tab_stop(&font.tabs, X);
+                }
+            }
+            prev = -1;
+            continue;
+        }
+
+        int code = str[i]-32;
+        if (kerning && prev >= 0)
+            X += kerning[prev][code];
+#ifdef FONT_MONOSPACE
+        X += font.glyph_widths[0];
+#else
+        X += font.glyph_widths[code];
+#endif
+        prev = code;
+    }
+
+    const char *last_line = str;
+    for (int i = 0; i < len; i++) {
+        if (str[i] == '\n')
+            last_line = str + i + 1;
+    }
+    if (font_line_is_open(last_line, str + len - last_line)) {
+        if (X > trailing[cell])
+            trailing[cell] = X;
+        num_lines++;
+    }
+
+    int max_width = 0;
+    int col_start = 0;
+    for (int c = 0; c < FONT_MAX_TAB_COLUMNS; c++) {
+        if (trailing[c] >= 0 && col_start + trailing[c] > max_width)
+            max_width = col_start + trailing[c];
+        col_start += col_width[c] + font.glyph_widths[0];
+    }
+
+    *width = max_width;
+    *lines = num_lines;
+}
+
+// width of the widest line and the number of lines, walks the string once
+static void font_measure(const char *str, int len, int *width, int *lines)
+{
+    if (font.tab_elastic && memchr(str, '\t', len)) {
+        font_measure_elastic(str, len, width, lines);
+        return;
+    }
+
+    int max_width = 0;
+    int num_lines = 0;
+
+    const char *ptr = str;
+    const char *end = str + len;
+    while (ptr < end) {
+        const char *eol = (const char*)memchr(ptr, '\n', end - ptr);
+        if (!eol) 
+            eol = end;
+
+        // control chars (tabs, markup, '\r' ...) take the slow path, which skips them like the layout does
+        int n = eol - ptr;
+        int slow = 0;
+        for (int k = 0; k < n; k++) {
+            if ((unsigned char)ptr[k] < 32) {
+                slow = 1;
+                break;
+            }
+        }
+        int w = slow ? font_line_width_tabs(ptr, n) : font_line_width(ptr, n);
+        if (w > max_width)
+            max_width = w;
+        if (eol < end || font_line_is_open(ptr, n))
+            num_lines++;
+
+        ptr = eol + 1;
+    }
+
+    *width = max_width;
+    *lines = num_lines;
+}
+
+void font_string_dimensions(char *str, int *width, int *height)
+{
+    if (font.initialized == 0)
+    {
+        font_init();
+    }
+
+    int lines;
+    font_measure(str, strlen(str), width, &lines);
+    *height = lines*font.height;
+}
+
+/*
+    Direct mapped cache of string measurements, indexed by a caller supplied hash 
+    of the string contents. An entry keeps a copy of the string, so two strings 
+    with the same hash are a miss rather than a wrong width. Cleared whenever 
+    the metrics change, and by font_init
+*/
+#define FONT_MEASURE_CACHE_SIZE 1024
+
+typedef struct Font_Measure_Entry {
+    unsigned int hash;      // 0 when empty
+    int len;
+    char *str;              // max_len long, the first len chars are the string
+    int max_len;
+    int width;
+    int height;
+} Font_Measure_Entry;
+
+static Font_Measure_Entry font_measure_cache[FONT_MEASURE_CACHE_SIZE];
+
+// empties every entry, the string copies are kept for reuse
+static void font_measure_cache_clear()
+{
+    for (int i = 0; i < FONT_MEASURE_CACHE_SIZE; i++) {
+        font_measure_cache[i].hash = 0;
+    }
+}
+
+/*
+    Measures num_strings strings in one call, writing the results to widths[] and heights[]
+
+    A string with len < 0 is assumed null terminated. Strings with a nonzero hash
+    are memoized under it. The contents are compared as well, so a hash that 
+    collides or goes stale costs a measurement, not a wrong width
+*/
+void font_measure_strings(const Font_String_View *strings, int num_strings, int *widths, int *heights)
+{
+    if (font.initialized == 0)
+    {
+        font_init();
+    }
+
+    for (int i = 0; i < num_strings; i++) {
+        const char *str = strings[i].str;
+        int len = strings[i].len < 0 ? (int)strlen(str) : strings[i].len;
+        unsigned int hash = strings[i].hash;
+
+        Font_Measure_Entry *entry = &font_measure_cache[hash % FONT_MEASURE_CACHE_SIZE];
+        if (hash != 0 && entry->hash == hash && entry->len == len && memcmp(entry->str, str, len) == 0) {
+            widths[i] = entry->width;
+            heights[i] = entry->height;
+            continue;
+        }
+
+        int lines;
+        font_measure(str, len, &widths[i], &lines);
+        heights[i] = lines*font.height;
+
+        if (hash != 0) {
+            if (!entry->str || len > entry->max_len) {
+                entry->max_len = len;
+                entry->str = (char*)realloc(entry->str, len + 1);
+            }
+            memcpy(entry->str, str, len);
+            entry->hash = hash;
+            entry->len = len;
+            entry->width = widths[i];
+            entry->height = heights[i];
+        }
+    }
+}
+
+Font *font_get_font()
+{
+    return &font;
+}
+
+/*
+    Loads pair kerning from a plain text file, one pair per line:
+
+        AV -1
+        To -1
+
+    i.e. the two characters of the pair followed by the adjustment in pixels.
+    Pairs outside the ascii range of the font are skipped. 
+    Returns the number of pairs read, and enables kerning if there were any
+*/
+int font_load_kerning(const char *filename)
+{
+    FILE *f = fopen(filename, "rb");
+    if (!f) {
+        printf("Could not open kerning file %s\n", filename);
+        return 0;
+    }
+
+    memset(font.kerning, 0, sizeof(font.kerning));
+
+    int num_pairs = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        int a = line[0]-32;
+        int b = line[1]-32;
+        int value;
+        if (sscanf(line+2, "%d", &value) != 1)
+            continue;
+        if (a < 0 || a >= NUM_GLYPHS || b < 0 || b >= NUM_GLYPHS)
+            continue;
+        if (value < -128) value = -128;
+        if (value >  127) value =  127;
+
+        font.kerning[a][b] = (signed char)value;
+        num_pairs++;
+    }
+    fclose(f);
+
+    printf("Read %d kerning pairs from %s\n", num_pairs, filename); fflush(stdout);
+    font_measure_cache_clear();
+    font_set_kerning(num_pairs > 0);
+
+    return num_pairs;
+}
+
+void font_set_align(Font_Align align, int align_width)
+{
+    font.align = align;
+    font.align_width = align_width;
+}
+
+/*
+    tab_width:  distance between regular tab stops in pixels, 0 for 4 spaces
+    stops:      explicit tab stops in pixels, in increasing order, used before the regular ones. Can be NULL
+    elastic:    size columns of tab separated cells to their widest cell instead
+*/
+static void font_tabs_init(Font_Tabs *tabs, int tab_width, const int *stops, int num_stops)
+{
+    if (num_stops > FONT_MAX_TAB_STOPS)
+        num_stops = FONT_MAX_TAB_STOPS;
+
+    tabs->width = tab_width;
+    tabs->num_stops = stops ? num_stops : 0;
+    for (int k = 0; k < tabs->num_stops; k++) {
+        tabs->stops[k] = stops[k];
+    }
+}
+
+void font_set_tabs(int tab_width, const int *stops, int num_stops, int elastic)
+{
+    font_tabs_init(&font.tabs, tab_width, stops, num_stops);
+    font.tab_elastic = elastic;
+
+    font_measure_cache_clear();
+}
+
+void font_set_kerning(int enabled)
+{
+#ifdef FONT_MONOSPACE
+    enabled = 0; // columns are fixed width
+#endif
+    if (font.kerning_enabled != enabled)
+        font_measure_cache_clear();
+    font.kerning_enabled = enabled;
+}
+
+static GLint font_uniform_location(GLuint program, const char *name)
+{
+    font.stats.uniform_lookups++;
+    return glGetUniformLocation(program, name);
+}
+
+static void font_uniforms_init(Font_Uniforms *u, GLuint program)
+{
+    memset(u, 0, sizeof(*u));
+    u->string_offset = font_uniform_location(program, "string_offset");
+    u->string_size = font_uniform_location(program, "string_size");
+    u->resolution = font_uniform_location(program, "resolution");
+    u->line_height = font_uniform_location(program, "line_height");
+    u->len = font_uniform_location(program, "len");
+    u->first_instance = font_uniform_location(program, "first_instance");
+    u->has_colors = font_uniform_location(program, "has_colors");
+    u->height = font_uniform_location(program, "height");
+    u->num_lines = font_uniform_location(program, "num_lines");
+    u->pass = font_uniform_location(program, "pass");
+}
+
+static void font_use_program(GLuint program)
+{
+    if (font.state.program == program) {
+        font.stats.skipped++;
+        return;
+    }
+    glUseProgram(program);
+    font.state.program = program;
+    font.stats.program_binds++;
+}
+
+static void font_bind_vao()
+{
+    if (font.state.vao == font.vao) {
+        font.stats.skipped++;
+        return;
+    }
+    glBindVertexArray(font.vao);
+    font.state.vao = font.vao;
+    font.stats.vao_binds++;
+}
+
+static void font_bind_texture(int unit, GLuint texture)
+{
+    if (font.state.textures[unit] == texture) {
+        font.stats.skipped++;
+        return;
+    }
+    glBindTextureUnit(unit, texture);
+    font.state.textures[unit] = texture;
+    font.stats.texture_binds++;
+}
+
+static void font_set_blend(int enabled)
+{
+    if (font.state.blend == enabled) {
+        font.stats.skipped++;
+        return;
+    }
+    if (enabled) {
+        // the fragment shader outputs coverage in alpha, so highlights behind the text show through
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    } else {
+        glDisable(GL_BLEND);
+    }
+    font.state.blend = enabled;
+    font.stats.blend_changes++;
+}
+
+// string_offset, string_size and resolution, unless the program already has them
+static void font_set_placement(Font_Uniforms *u, float offset[2], float size[2], float res[2])
+{
+    float placement[6] = {offset[0], offset[1], size[0], size[1], res[0], res[1]};
+    if (u->placement_valid && memcmp(u->placement, placement, sizeof(placement)) == 0) {
+        font.stats.skipped++;
+        return;
+    }
+    glUniform2fv(u->string_offset, 1, offset);
+    glUniform2fv(u->string_size, 1, size);
+    glUniform2fv(u->resolution, 1, res);
+    memcpy(u->placement, placement, sizeof(placement));
+    u->placement_valid = 1;
+    font.stats.uniform_uploads += 3;
+}
+
+// num_lines, has_colors and height of the pull program, unless it already has them
+static void font_set_pull(Font_Uniforms *u, int num_lines, int has_colors, float height)
+{
+    if (u->pull_valid && u->pull[0] == num_lines && u->pull[1] == has_colors && u->pull_height == height) {
+        font.stats.skipped++;
+        return;
+    }
+    glUniform1i(u->num_lines, num_lines);
+    glUniform1i(u->has_colors, has_colors);
+    glUniform1f(u->height, height);
+    u->pull[0] = num_lines;
+    u->pull[1] = has_colors;
+    u->pull_height = height;
+    u->pull_valid = 1;
+    font.stats.uniform_uploads += 3;
+}
+
+// uploads the palettes if they changed since the last draw, and binds them
+static void font_colors_update()
+{
+    if (font.colors_dirty) {
+        float ubo[9*FONT_MAX_PALETTES][4];
+        memcpy(font.palettes[0], colors, sizeof(colors));
+        for (int p = 0; p < FONT_MAX_PALETTES; p++) {
+            for (int i = 0; i < 9; i++) {
+                ubo[9*p + i][0] = font.palettes[p][3*i + 0];
+                ubo[9*p + i][1] = font.palettes[p][3*i + 1];
+                ubo[9*p + i][2] = font.palettes[p][3*i + 2];
+                ubo[9*p + i][3] = 1.0;
+            }
+        }
+        glNamedBufferSubData(font.ubo_colors, 0, sizeof(ubo), ubo);
+        font.colors_dirty = 0;
+        font.stats.uniform_uploads++;
+    }
+
+    if (font.state.ubo_colors == font.ubo_colors) {
+        font.stats.skipped++;
+        return;
+    }
+    glBindBufferBase(GL_UNIFORM_BUFFER, 0, font.ubo_colors);
+    font.state.ubo_colors = font.ubo_colors;
+}
+
+/*
+    For code that changes the program, vao, texture units 0 and 1, uniform
+    buffer 0 or GL_BLEND between font calls. The font code leaves blending on
+*/
+void font_invalidate_state()
+{
+    memset(&font.state, 0, sizeof(font.state));
+    font.state.blend = -1;
+}
+
+void font_get_stats(Font_Stats *stats)
+{
+    *stats = font.stats;
+}
+
+void font_reset_stats()
+{
+    memset(&font.stats, 0, sizeof(font.stats));
+}
+
+/*
+    Waits for the gpu to finish drawing fenced frame f, and forgets it and all 
+    the frames before it, fences signal in order so those are done as well
+*/
+static void font_ring_wait(int f)
+{
+    GLsync fence = font.ring_frames[f].fence;
+    GLenum result = glClientWaitSync(fence, 0, 0);
+    while (result == GL_TIMEOUT_EXPIRED) {
+        result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+    }
+    for (int k = 0; k <= f; k++) {
+        glDeleteSync(font.ring_frames[k].fence);
+    }
+
+    font.ring_num_frames -= f + 1;
+    memmove(font.ring_frames, font.ring_frames + f + 1, sizeof(Font_Ring_Frame)*font.ring_num_frames);
+}
+
+/*
+    Places a fence behind the draws of the glyphs written since the last one, 
+    and records where they are. font_flush calls this at the end of every frame.
+    Once all FONT_RING_FRAMES are in use, a frame that follows on from the newest
+    one is merged into it, as its fence also covers everything before it
+*/
+static void font_ring_fence()
+{
+    if (!font.ring || font.ring_head == font.ring_frame_start)
+        return;
+
+    GLsync fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    Font_Ring_Frame *newest = &font.ring_frames[FONT_RING_FRAMES-1];
+    if (font.ring_num_frames == FONT_RING_FRAMES && newest->end == font.ring_frame_start) {
+        glDeleteSync(newest->fence);
+        newest->end = font.ring_head;
+        newest->fence = fence;
+    } else {
+        if (font.ring_num_frames == FONT_RING_FRAMES)
+            font_ring_wait(0);
+        Font_Ring_Frame *f = &font.ring_frames[font.ring_num_frames++];
+        f->first = font.ring_frame_start;
+        f->end = font.ring_head;
+        f->fence = fence;
+    }
+    font.ring_frame_start = font.ring_head;
+}
+
+/*
+    Returns room for max_glyphs glyphs in the ring. A layout never wraps around
+    the end, it starts over at the beginning instead. Before writing, we wait for
+    the newest fenced frame that is still drawn from that room, which only blocks 
+    if the gpu is a whole ring behind. A frame that writes more than font.capacity 
+    glyphs is fenced on the way, so it never has to wait for itself
+*/
+static Font_Glyph *font_ring_reserve(int max_glyphs)
+{
+    if (font.ring_head - font.ring_frame_start >= font.capacity)
+        font_ring_fence();
+
+    if (font.ring_head + max_glyphs > font.capacity*FONT_RING_REGIONS) {
+        font_ring_fence();
+        font.ring_head = 0;
+        font.ring_frame_start = 0;
+    }
+
+    // frames left behind the end at the last wrap can be older than the ones at the start
+    int end = font.ring_head + max_glyphs;
+    for (int f = font.ring_num_frames-1; f >= 0; f--) {
+        if (font.ring_frames[f].first < end && font.ring_frames[f].end > font.ring_head) {
+            font_ring_wait(f);
+            break;
+        }
+    }
+
+    return font.ring + font.ring_head;
+}
+
+/*
+    Uploads only the blocks of glyphs that differ from the last upload, which
+    font.shadow keeps a copy of. A status line where only the clock changes 
+    costs one block instead of the whole string.
+    Runs of dirty blocks become one glBufferSubData each, once we're out of
+    FONT_MAX_UPLOAD_RANGES the last range just grows to cover the rest
+*/
+static void font_upload_diff(const Font_Glyph *glyphs, int num_glyphs)
+{
+    if (!font.shadow)
+        font.shadow = (Font_Glyph*)malloc(sizeof(Font_Glyph)*font.capacity);
+
+    int range_first[FONT_MAX_UPLOAD_RANGES];
+    int range_end[FONT_MAX_UPLOAD_RANGES];
+    int num_ranges = 0;
+
+    for (int first = 0; first < num_glyphs; first += FONT_DIFF_BLOCK) {
+        int end = first + FONT_DIFF_BLOCK;
+        if (end > num_glyphs)
+            end = num_glyphs;
+
+        // past the end of the last upload there's nothing to compare to
+        if (end <= font.shadow_len && memcmp(glyphs + first, font.shadow + first, sizeof(Font_Glyph)*(end - first)) == 0)
+            continue;
+
+        if (num_ranges > 0 && (range_end[num_ranges-1] == first || num_ranges == FONT_MAX_UPLOAD_RANGES)) {
+            range_end[num_ranges-1] = end;
+        } else {
+            range_first[num_ranges] = first;
+            range_end[num_ranges] = end;
+            num_ranges++;
+        }
+    }
+
+    int uploaded = 0;
+    glBindBuffer(GL_ARRAY_BUFFER, font.vbo_code_instances);
+    for (int r = 0; r < num_ranges; r++) {
+        int first = range_first[r];
+        int count = range_end[r] - first;
+        glBufferSubData(GL_ARRAY_BUFFER, sizeof(Font_Glyph)*first, sizeof(Font_Glyph)*count, glyphs + first);
+        memcpy(font.shadow + first, glyphs + first, sizeof(Font_Glyph)*count);
+        uploaded += count;
+    }
+
+    if (num_glyphs > font.shadow_len)
+        font.shadow_len = num_glyphs;
+    font.upload_bytes += (long long)sizeof(Font_Glyph)*uploaded;
+    font.upload_bytes_saved += (long long)sizeof(Font_Glyph)*(num_glyphs - uploaded);
+}
+
+static const char *font_stream_names[FONT_STREAM_COUNT] = {
+    "SubData", "Orphan", "MapBufferRange unsync", "Persistent coherent", "Persistent flush"
+};
+
+static int font_stream_is_persistent(Font_Stream stream)
+{
+    return stream == FONT_STREAM_PERSISTENT || stream == FONT_STREAM_PERSISTENT_FLUSH;
+}
+
+/*
+    Creates vbo_code_instances for font.stream, with room for layouts of capacity glyphs.
+    The streams that append keep FONT_RING_REGIONS layouts worth of space, SubData 
+    and Orphan overwrite the start with every layout. 
+
+    The persistent mapping used to overwrite glyphs the gpu was still reading.
+    now every layout gets its own range of a ring, and a range is only reused
+    once the fence of the frame that wrote it has signaled, see font_ring_reserve.
+    The ring is only ever written, a layout that reads back what it wrote is
+    laid out in staging and copied over, see font_layout
+*/
+static void font_stream_create(int capacity)
+{
+    for (int f = 0; f < font.ring_num_frames; f++) {
+        glDeleteSync(font.ring_frames[f].fence);
+    }
+    font.ring_num_frames = 0;
+    font.ring_frame_start = 0;
+    font.ring_head = 0;
+    font.first_instance = 0;
+    font.shadow_len = 0;
+    font.ring = NULL;
+
+    int overwrite = font.stream == FONT_STREAM_SUBDATA || font.stream == FONT_STREAM_ORPHAN;
+    GLsizeiptr size = (GLsizeiptr)sizeof(Font_Glyph)*capacity*(overwrite ? 1 : FONT_RING_REGIONS);
+
+    glCreateBuffers(1, &font.vbo_code_instances);
+    if (font_stream_is_persistent(font.stream)) {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT;
+        GLbitfield map_flags = flags;
+        if (font.stream == FONT_STREAM_PERSISTENT) {
+            flags |= GL_MAP_COHERENT_BIT;
+            map_flags |= GL_MAP_COHERENT_BIT;
+        } else {
+            map_flags |= GL_MAP_FLUSH_EXPLICIT_BIT;
+        }
+        glNamedBufferStorage(font.vbo_code_instances, size, NULL, flags);
+        font.ring = (Font_Glyph*)glMapNamedBufferRange(font.vbo_code_instances, 0, size, map_flags);
+    } else {
+        glNamedBufferData(font.vbo_code_instances, size, NULL, font.stream == FONT_STREAM_SUBDATA ? GL_DYNAMIC_DRAW : GL_STREAM_DRAW);
+    }
+    font.staging = (Font_Glyph*)realloc(font.staging, sizeof(Font_Glyph)*capacity);
+    font.text_glyph_data = font.ring ? font.ring : font.staging;
+
+    glVertexArrayVertexBuffer(font.vao, 1, font.vbo_code_instances, 0, sizeof(Font_Glyph));
+}
+
+/*
+    Returns where the next layout of up to max_glyphs glyphs is written, and sets
+    font.first_instance to where it ends up in vbo_code_instances.
+    That's room in the ring for the persistent streams, staging for the others
+*/
+static Font_Glyph *font_stream_begin(int max_glyphs)
+{
+    switch (font.stream) {
+    case FONT_STREAM_PERSISTENT:
+    case FONT_STREAM_PERSISTENT_FLUSH: {
+        Font_Glyph *glyphs = font_ring_reserve(max_glyphs);
+        font.first_instance = font.ring_head;
+        return glyphs;
+    }
+    case FONT_STREAM_MAP_UNSYNC:
+        // nothing the gpu may still read is ever written, until the buffer is full.
+        // then it's orphaned, and we start over with fresh storage
+        if (font.ring_head + max_glyphs > font.capacity*FONT_RING_REGIONS) {
+            glNamedBufferData(font.vbo_code_instances, sizeof(Font_Glyph)*font.capacity*FONT_RING_REGIONS, NULL, GL_STREAM_DRAW);
+            font.ring_head = 0;
+        }
+        font.first_instance = font.ring_head;
+        return font.staging;
+    default:
+        font.first_instance = 0;
+        return font.staging;
+    }
+}
+
+/*
+    Gets the num_glyphs glyphs written since font_stream_begin to the gpu.
+    on_gpu: the compute shader wrote them, so there's nothing to upload
+*/
+static void font_stream_end(int num_glyphs, int on_gpu)
+{
+    GLintptr offset = sizeof(Font_Glyph)*font.first_instance;
+    GLsizeiptr size = sizeof(Font_Glyph)*num_glyphs;
+
+    switch (font.stream) {
+    case FONT_STREAM_SUBDATA:
+        if (on_gpu)
+            font.shadow_len = 0; // the compute shader writes behind font_upload_diff's back
+        else
+            font_upload_diff(font.staging, num_glyphs);
+        return;
+    case FONT_STREAM_ORPHAN:
+        if (!on_gpu) {
+            glNamedBufferData(font.vbo_code_instances, sizeof(Font_Glyph)*font.capacity, NULL, GL_STREAM_DRAW);
+            glNamedBufferSubData(font.vbo_code_instances, 0, size, font.staging);
+        }
+        break;
+    case FONT_STREAM_MAP_UNSYNC:
+        if (!on_gpu && num_glyphs > 0) {
+            GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT;
+            void *dst = glMapNamedBufferRange(font.vbo_code_instances, offset, size, flags);
+            memcpy(dst, font.staging, size);
+            glUnmapNamedBuffer(font.vbo_code_instances);
+        }
+        font.ring_head += num_glyphs;
+        break;
+    case FONT_STREAM_PERSISTENT_FLUSH:
+        if (!on_gpu && num_glyphs > 0)
+            glFlushMappedNamedBufferRange(font.vbo_code_instances, offset, size);
+        font.ring_head += num_glyphs;
+        break;
+    default:
+        font.ring_head += num_glyphs;
+        break;
+    }
+
+    if (!on_gpu)
+        font.upload_bytes += size;
+}
+
+// chunks of the gpu layout for len chars, at least one so ssbo_chunks is never empty
+static int font_layout_chunks(int len)
+{
+    int chunks = (len + FONT_LAYOUT_CHUNK - 1)/FONT_LAYOUT_CHUNK;
+    return chunks > 0 ? chunks : 1;
+}
+
+/*
+    Replaces vbo_code_instances, for a new capacity or stream. The last layout 
+    is copied over to the new vbo on the gpu, so it can still be drawn, and a 
+    copy in staging stays where it is for hit testing. The old vbo is deleted 
+    right after, GL keeps it alive until the copy and the draws reading from it
+    are done. gpu and pulled layouts aren't carried over, their glyph count and
+    chars only exist on the gpu, in buffers that are replaced as well
+*/
+static void font_stream_rebuild(Font_Stream stream, int capacity)
+{
+    GLuint old_vbo = font.vbo_code_instances;
+    GLintptr old_offset = sizeof(Font_Glyph)*font.first_instance;
+    int ctr = font.ctr;
+    int in_staging = font.staging && font.text_glyph_data == font.staging;
+
+    font.stream = stream;
+    font_stream_create(capacity);
+
+    if (font.shadow)
+        font.shadow = (Font_Glyph*)realloc(font.shadow, sizeof(Font_Glyph)*capacity);
+    font.gpu_layout = 0;
+    font.pulled = 0;
+
+    if (ctr > 0) {
+        Font_Glyph *glyphs = font_stream_begin(ctr);
+        glCopyNamedBufferSubData(old_vbo, font.vbo_code_instances, old_offset, sizeof(Font_Glyph)*font.first_instance, sizeof(Font_Glyph)*ctr);
+        font_stream_end(ctr, 1);
+        font.text_glyph_data = in_staging ? font.staging : glyphs;
+    }
+    glDeleteBuffers(1, &old_vbo);
+}
+
+/*
+    Reads easy_font_raw.png and extracts the font info
+    i.e. offset and width of each glyph, by parsing the first row 
+    containing black dots
+
+
+    Initialize opengl stuff in the font struct, based on the data read from the file
+
+    Creates one grayscale 2D texture containing the font bitmap data (as in the .png file)
+    and one RGBA32F 1D texture containing font metadata, i.e. for some ascii code, where
+    does it have to go to find that glyph in the 2D texture, and how much should it get
+
+    Creates the vbo used for updating and drawing text. 
+    Initially has a max length of MAX_STRING_LEN, but you're not obliged to use all of it,
+    and it grows if you need more
+*/
+void font_init()
+{
+    font.initialized = 1;
+
+    // anything measured before there were any metrics is wrong
+    font_measure_cache_clear();
+
+    // the shaders see the same compile time options as the layout code
+    char defines[256];
+    const char *options = ""
+#ifdef FONT_MONOSPACE
+        "#define FONT_MONOSPACE\n"
+#endif
+#ifdef FONT_PACKED_INSTANCES
+        "#define FONT_PACKED_INSTANCES\n"
+#endif
+        ;
+    snprintf(defines, sizeof(defines), "%s#define FONT_MAX_PALETTES %d\n", options, FONT_MAX_PALETTES);
+    font.program = LoadShadersDefines2( "vertex_shader_text.vs", "fragment_shader_text.fs", defines );
+    font.program_rect = LoadShaders2( "vertex_shader_rect.vs", "fragment_shader_rect.fs" );
+    font.program_layout = LoadComputeShaderDefines2( "compute_shader_layout.cs", defines );
+
+    char pull_defines[sizeof(defines) + 32]; // room for defines and the one line after it
+    snprintf(pull_defines, sizeof(pull_defines), "%s#define FONT_PULL\n", defines);
+    font.program_pull = LoadShadersDefines2( "vertex_shader_text.vs", "fragment_shader_text.fs", pull_defines );
+
+    char batch_defines[sizeof(defines) + 32];
+    snprintf(batch_defines, sizeof(batch_defines), "%s#define FONT_BATCH\n", defines);
+    font.program_batch = LoadShadersDefines2( "vertex_shader_text.vs", "fragment_shader_text.fs", batch_defines );
+
+    font_uniforms_init(&font.uniforms, font.program);
+    font_uniforms_init(&font.uniforms_rect, font.program_rect);
+    font_uniforms_init(&font.uniforms_layout, font.program_layout);
+    font_uniforms_init(&font.uniforms_pull, font.program_pull);
+    font_uniforms_init(&font.uniforms_batch, font.program_batch);
+    font_invalidate_state();
+
+    int x, y, n;
+    unsigned char *data = stbi_load("vass_font.png", &x, &y, &n, 0);
+    printf("%d %d %d\n", x, y, n);fflush(stdout);
+    //return;
+
+    // scan once to count the spacing between the black dots to get the width of each glyph
+    // and the offset to reach that glyph
+    // NOTE: Ugly, but works. Can this be cleaned up?
+    int num = 0;
+    int width = 0;
+    for (int i = 0; i < x; i++) {
+        if (data[n*i+0] == 0 && data[n*i+1] == 0 && data[n*i+2] == 0) {
+            if (i != 0) {
+                font.glyph_widths[num-1] = width;
+                width = 0;
+            } 
+            font.glyph_offsets[num] = i;
+
+            num++;
+        }
+        width++;
+    }
+    font.glyph_widths[num-1] = width;
+
+    // convert the RGB texture into a 1-byte texture, strip the first line (containing width info)
+    // add padding, so that texture width is a multiple of 4 (for opengl packing compliance)
+    // y-axis is flipped (since input image is in image space, i.e. +Y is downwards)
+    font.height = y-1;
+    font.width = x;
+    font.width_padded = (font.width + 3) & ~0x03;
+
+    unsigned char *font_bitmap = (unsigned char*)malloc(font.width_padded*font.height);
+
+    for (int j = 0; j < font.height; j++) {
+        for (int i = 0; i < font.width; i++) {
+            int k1 = (j+1)*font.width + i;
+            int k2 = (font.height - j - 1)*font.width_padded + i; // flip y-axis of texture
+
+            int R = data[n*k1+0];
+            int G = data[n*k1+1];
+            int B = data[n*k1+2];
+            
+            // red = vertical segment, blue = horisontal segment
+            if ((R == 255 || B == 255) && G == 0) {
+                font_bitmap[k2] = 0;
+            } else {
+                font_bitmap[k2] = 255;
+            }
+        }
+    }
+
+    free(data); 
+
+    //-------------------------------------------------------------------------
+    glGenVertexArrays(1, &font.vao);
+    font_bind_vao();
+
+    //-------------------------------------------------------------------------
+    // glyph vertex positions, just uv coordinates that will be stretched accordingly 
+    // by the glyphs width and height
+    float v[] = {0.0, 0.0, 
+                 1.0, 0.0, 
+                 0.0, 1.0,
+                 0.0, 1.0,
+                 1.0, 0.0,
+                 1.0, 1.0};
+
+    glCreateBuffers(1, &font.vbo_glyph_pos_instance);
+    glNamedBufferStorage(font.vbo_glyph_pos_instance, sizeof(v), v, 0);
+    
+    glEnableVertexArrayAttrib(font.vao, 0);
+    glVertexArrayVertexBuffer(font.vao, 0, font.vbo_glyph_pos_instance, 0, 2*sizeof(float));
+    glVertexArrayAttribFormat(font.vao, 0, 2, GL_FLOAT, GL_FALSE, 0);
+    glVertexArrayBindingDivisor(font.vao, 0, 0);
+
+    //-------------------------------------------------------------------------
+    // instanced vbo for glyph position ascii value and color index
+    // @Incomplete: ring is never unmapped
+    font.capacity = MAX_STRING_LEN;
+#ifdef FONT_NO_DSA_VBO
+    font.stream = FONT_STREAM_SUBDATA;
+#else
+    font.stream = FONT_STREAM_PERSISTENT;
+#endif
+    font_stream_create(font.capacity);
+    
+    glEnableVertexArrayAttrib(font.vao, 1);
+#ifdef FONT_PACKED_INSTANCES
+    // (x, y, glyph | color << 8, flags) as shorts, unpacked in the vertex shader
+    glVertexArrayAttribIFormat(font.vao, 1, 4, GL_SHORT, 0);
+#else
+    glVertexArrayAttribFormat(font.vao, 1, 4, GL_FLOAT, GL_FALSE, 0);
+#endif
+    glVertexArrayBindingDivisor(font.vao, 1, 1);
+
+    // highlight rects, the buffer is bound (and the attribute enabled) when drawing them
+    glVertexArrayAttribFormat(font.vao, 2, 4, GL_FLOAT, GL_FALSE, 0);
+    glVertexArrayAttribBinding(font.vao, 2, 2);
+    glVertexArrayBindingDivisor(font.vao, 2, 1);
+
+    //-------------------------------------------------------------------------
+    // gpu layout only uploads the raw chars, the compute shader writes the glyphs
+    // into vbo_code_instances and their number into buffer_command
+    glCreateBuffers(1, &font.ssbo_text);
+    glNamedBufferData(font.ssbo_text, (font.capacity + 3) & ~3, NULL, GL_DYNAMIC_DRAW);
+    glCreateBuffers(1, &font.ssbo_colors);
+    glNamedBufferData(font.ssbo_colors, (font.capacity + 3) & ~3, NULL, GL_DYNAMIC_DRAW);
+    glCreateBuffers(1, &font.buffer_command);
+    glNamedBufferStorage(font.buffer_command, 4*sizeof(GLuint), NULL, 0);
+    glCreateBuffers(1, &font.ssbo_chunks);
+    glNamedBufferData(font.ssbo_chunks, 4*sizeof(GLuint)*font_layout_chunks(font.capacity), NULL, GL_DYNAMIC_DRAW);
+    glCreateBuffers(1, &font.ssbo_lines);
+    glNamedBufferData(font.ssbo_lines, sizeof(int)*(font.capacity + 1), NULL, GL_DYNAMIC_DRAW);
+    glCreateBuffers(1, &font.ssbo_pull_x);
+    glNamedBufferData(font.ssbo_pull_x, sizeof(float)*font.capacity, NULL, GL_DYNAMIC_DRAW);
+
+    for (int p = 0; p < FONT_MAX_PALETTES; p++) {
+        memcpy(font.palettes[p], colors, sizeof(colors));
+    }
+    glCreateBuffers(1, &font.ubo_colors);
+    glNamedBufferData(font.ubo_colors, sizeof(float)*4*9*FONT_MAX_PALETTES, NULL, GL_DYNAMIC_DRAW);
+    font.colors_dirty = 1;
+
+    float layout_widths[NUM_GLYPHS];
+    for (int i = 0; i < NUM_GLYPHS; i++) {
+        layout_widths[i] = font.glyph_widths[i];
+    }
+    glProgramUniform1fv(font.program_layout, font_uniform_location(font.program_layout, "glyph_widths"), NUM_GLYPHS, layout_widths);
+#ifdef FONT_MONOSPACE
+    // the column pitch, the same FONT_UNIT the layout and the bounds go by
+    GLuint text_programs[3] = {font.program, font.program_pull, font.program_batch};
+    for (int k = 0; k < 3; k++) {
+        glProgramUniform1f(text_programs[k], font_uniform_location(text_programs[k], "column_width"), FONT_UNIT);
+    }
+#endif
+
+    //-------------------------------------------------------------------------
+    // create 2D texture and upload font bitmap data
+    glCreateTextures(GL_TEXTURE_2D, 1, &font.texture_fontdata);
+    glTextureParameteri(font.texture_fontdata, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTextureParameteri(font.texture_fontdata, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTextureParameteri(font.texture_fontdata, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTextureParameteri(font.texture_fontdata, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTextureStorage2D(font.texture_fontdata, 1, GL_R8, font.width_padded, font.height);
+
+    // the bitmap goes up through the pbo ring like any later update, see font_atlas_flush
+    GLsizeiptr pbo_size = (GLsizeiptr)font.width_padded*font.height*FONT_ATLAS_PBOS;
+    GLbitfield pbo_flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glCreateBuffers(1, &font.atlas_pbo);
+    glNamedBufferStorage(font.atlas_pbo, pbo_size, NULL, pbo_flags);
+    font.atlas_pbo_data = (unsigned char*)glMapNamedBufferRange(font.atlas_pbo, 0, pbo_size, pbo_flags);
+    font.atlas_pixels = font_bitmap;
+    font_atlas_update(0, 0, font.width_padded, font.height, NULL);
+
+    //-------------------------------------------------------------------------
+    // create 1D texture and upload font metadata
+    // used for lookup in the bitmap texture    
+    float *texture_metadata = (float*)malloc(sizeof(float)*4*NUM_GLYPHS);
+    
+    for (int i = 0; i < NUM_GLYPHS; i++) {
+        // all the glyphs are in a single line, but in principle we can support multiple lines
+        texture_metadata[4*i+0] = font.glyph_offsets[i]/(double)font.width_padded;
+        texture_metadata[4*i+1] = 0.0;
+        texture_metadata[4*i+2] = font.glyph_widths[i]/(double)font.width_padded;
+        texture_metadata[4*i+3] = 1.0;
+    }
+
+    glCreateTextures(GL_TEXTURE_1D, 1, &font.texture_metadata);
+    glTextureParameteri(font.texture_metadata, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTextureParameteri(font.texture_metadata, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTextureStorage1D(font.texture_metadata, 1, GL_RGBA32F, font.width_padded);
+    glTextureSubImage1D(font.texture_metadata, 0, 0, font.width_padded, GL_RGBA, GL_FLOAT, texture_metadata);
+
+    free(texture_metadata);
+}
+
+// glyph_chars needs room for max_glyphs
+static void font_index_reset(Font_Text_Index *index, int max_glyphs)
+{
+    if (!index->glyph_chars) 
+        index->glyph_chars = (int*)malloc(sizeof(int)*max_glyphs);
+    if (!index->line_glyphs) {
+        index->max_lines = 256;
+        index->line_glyphs = (int*)malloc(sizeof(int)*index->max_lines);
+        index->line_chars = (int*)malloc(sizeof(int)*index->max_lines);
+    }
+
+    // line 0 starts at the beginning
+    index->num_lines = 1;
+    index->line_glyphs[0] = 0;
+    index->line_chars[0] = 0;
+}
+
+static void font_index_add_line(Font_Text_Index *index, int first_glyph, int first_char)
+{
+    if (index->num_lines == index->max_lines) {
+        index->max_lines *= 2;
+        index->line_glyphs = (int*)realloc(index->line_glyphs, sizeof(int)*index->max_lines);
+        index->line_chars = (int*)realloc(index->line_chars, sizeof(int)*index->max_lines);
+    }
+    index->line_glyphs[index->num_lines] = first_glyph;
+    index->line_chars[index->num_lines] = first_char;
+    index->num_lines++;
+}
+
+static void font_index_free(Font_Text_Index *index)
+{
+    free(index->line_glyphs);
+    free(index->line_chars);
+    free(index->glyph_chars);
+    memset(index, 0, sizeof(*index));
+}
+
+/*
+    Char offset of the caret position closest to the window coordinates (x, y), 
+    given in pixels from the top left corner like glfw reports the cursor.
+    Inverts the vertex shader transform, finds the line from y, and does a 
+    binary search on the glyph positions of that line. -1 if there is no text
+*/
+static int font_index_query(Font_Text_Index *index, Font_Glyph *glyphs, int num_glyphs, double x, double y, float offset[2], float size[2], float res[2])
+{
+    if (index->num_lines == 0)
+        return -1;
+
+    // window -> NDC -> string space in pixels
+    double ndc_x = 2.0*x/res[0] - 1.0;
+    double ndc_y = 1.0 - 2.0*y/res[1];
+    double string_x = (ndc_x - offset[0])*res[0]/(2.0*size[0]);
+    double string_y = (ndc_y - offset[1])*res[1]/(2.0*size[1]);
+
+    // line k covers y in [-k*height, -(k-1)*height]
+    int line = (int)floor(1.0 - string_y/font.height);
+    if (line < 0) 
+        line = 0;
+    if (line >= index->num_lines) 
+        line = index->num_lines-1;
+
+    int first = index->line_glyphs[line];
+    int last = line+1 < index->num_lines ? index->line_glyphs[line+1] : num_glyphs;
+    if (first == last)
+        return index->line_chars[line];
+
+    // last glyph that starts left of the point
+    float X = string_x/FONT_UNIT;
+    int lo = first;
+    int hi = last-1;
+    if (X < glyphs[lo].x)
+        return index->line_chars[line]; // left of the first glyph, which might come after a tab
+    while (lo < hi) {
+        int mid = (lo + hi + 1)/2;
+        if (glyphs[mid].x <= X)
+            lo = mid;
+        else
+            hi = mid-1;
+    }
+
+#ifdef FONT_MONOSPACE
+    float width = 1.0;
+#else
+    float width = font.glyph_widths[(int)glyphs[lo].glyph];
+#endif
+    if (X - glyphs[lo].x > 0.5f*width)
+        return index->glyph_chars[lo]+1;
+
+    return index->glyph_chars[lo];
+}
+
+// first of the glyphs [lo, hi) that comes from a char at or after offset
+static int font_index_lower_bound(Font_Text_Index *index, int lo, int hi, int offset)
+{
+    while (lo < hi) {
+        int mid = (lo + hi)/2;
+        if (index->glyph_chars[mid] < offset)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static void font_highlights_push(Font_Highlights *h, float x, float y, float width, int color)
+{
+    if (h->count == h->capacity) {
+        h->capacity = h->capacity ? 2*h->capacity : 64;
+        h->rects = (float*)realloc(h->rects, sizeof(float)*4*h->capacity);
+    }
+
+    float *r = h->rects + 4*h->count++;
+    r[0] = x;
+    r[1] = y;
+    r[2] = width;
+    r[3] = color;
+}
+
+/*
+    Appends one rectangle per line covered by the chars [begin, end), using the 
+    line table to find the lines and binary searches to find the glyphs, so the 
+    cost only depends on the number of lines in the range
+*/
+static void font_index_highlight(Font_Highlights *h, Font_Text_Index *index, Font_Glyph *glyphs, int num_glyphs, int begin, int end, int color)
+{
+    if (index->num_lines == 0 || end <= begin)
+        return;
+
+    // last line that starts at or before begin
+    int lo = 0;
+    int hi = index->num_lines-1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1)/2;
+        if (index->line_chars[mid] <= begin)
+            lo = mid;
+        else
+            hi = mid-1;
+    }
+
+    for (int line = lo; line < index->num_lines && index->line_chars[line] < end; line++) {
+        int first = index->line_glyphs[line];
+        int last = line+1 < index->num_lines ? index->line_glyphs[line+1] : num_glyphs;
+
+        // right edge of the last glyph on the line
+        float line_end = 0.0;
+        if (last > first) {
+#ifdef FONT_MONOSPACE
+            line_end = glyphs[(last-1)].x + 1.0f;
+#else
+            line_end = glyphs[(last-1)].x + font.glyph_widths[(int)glyphs[(last-1)].glyph];
+#endif
+        }
+
+        int g0 = font_index_lower_bound(index, first, last, begin);
+        int g1 = font_index_lower_bound(index, g0, last, end);
+        float x0 = g0 < last ? glyphs[g0].x : line_end;
+        float x1 = g1 < last ? glyphs[g1].x : line_end;
+
+        // a selected newline is shown as a space at the end of the line
+        if (line+1 < index->num_lines && end >= index->line_chars[line+1])
+            x1 += font.glyph_widths[0]/FONT_UNIT;
+
+        if (x1 > x0)
+            font_highlights_push(h, x0*FONT_UNIT, -line*font.height, (x1 - x0)*FONT_UNIT, color);
+    }
+}
+
+/*
+    Shifts the glyphs [first, last) of a line that has just been laid out, 
+    according to state->align. Called at the end of each line during layout, 
+    when the width of the line is known, so the string is only walked once
+*/
+static void font_align_line(Font_Layout_State *state, Font_Glyph *glyphs, int first, int last, float line_width, int is_last_line)
+{
+    float align_width = state->align_width/FONT_UNIT;
+
+    float shift;
+    switch (state->align) {
+    case FONT_ALIGN_RIGHT:
+        shift = -line_width;
+        break;
+    case FONT_ALIGN_CENTER:
+        shift = floorf(-0.5f*line_width); // keep glyphs on whole pixels
+        break;
+    case FONT_ALIGN_JUSTIFY: {
+        if (is_last_line || line_width >= align_width)
+            return;
+
+        int num_spaces = 0;
+        for (int k = first; k < last; k++) {
+            num_spaces += glyphs[k].glyph == 0; // ' ' is glyph 0
+        }
+        if (num_spaces == 0)
+            return;
+
+        float extra = (align_width - line_width)/num_spaces;
+        int spaces_seen = 0;
+        for (int k = first; k < last; k++) {
+            glyphs[k].x += floorf(extra*spaces_seen);
+            spaces_seen += glyphs[k].glyph == 0;
+        }
+        return;
+    }
+    default:
+        return;
+    }
+
+    for (int k = first; k < last; k++) {
+        glyphs[k].x += shift;
+    }
+}
+
+// the current layout options of the font. render thread only
+static void font_layout_options(Font_Layout_Options *options)
+{
+    options->align = font.align;
+    options->align_width = font.align_width;
+    options->markup = font.markup_enabled;
+    options->kerning = font.kerning_enabled;
+    options->tab_elastic = font.tab_elastic;
+    options->tabs = font.tabs;
+}
+
+// layout from here on only reads options, the glyph widths and the kerning table
+static void font_layout_begin_options(Font_Layout_State *state, const Font_Layout_Options *options)
+{
+    memset(state, 0, sizeof(*state));
+    state->prev = -1;
+    for (int c = 0; c < FONT_MAX_TAB_COLUMNS; c++) {
+        state->trailing[c] = -1.0;
+    }
+
+    // in elastic mode X is relative to the start of the current cell, and the
+    // glyphs are moved into their columns once all the column widths are known
+    state->elastic = options->tab_elastic;
+    state->markup = options->markup;
+    state->kerning = options->kerning;
+    state->tabs = options->tabs;
+
+    // elastic columns are only known at the end of the string, so those are always left aligned
+    state->align = state->elastic ? FONT_ALIGN_LEFT : options->align;
+    state->align_width = options->align_width;
+#ifdef FONT_PACKED_INSTANCES
+    if (state->align == FONT_ALIGN_JUSTIFY && state->align_width/FONT_UNIT > FONT_PACKED_MAX)
+        state->overflow = 1;
+#endif
+}
+
+static void font_layout_begin(Font_Layout_State *state)
+{
+    Font_Layout_Options options;
+    font_layout_options(&options);
+    font_layout_begin_options(state, &options);
+}
+
+/*
+    Lays out the chars [begin, end) of str, appending one Font_Glyph per glyph to glyphs:
+    (x, y, glyph index, color index), untagged. Can be called repeatedly on consecutive 
+    pieces of the same string, the position is carried over in state.
+    tab_cells has room for one byte per glyph, and is only used in elastic mode
+*/
+static void font_layout_run(Font_Layout_State *state, const char *str, const char *col, int begin, int end, Font_Glyph *glyphs, unsigned char *tab_cells)
+{
+#ifdef FONT_PACKED_INSTANCES
+    if (state->overflow)
+        return;
+#endif
+    float X = state->X;
+    float Y = state->Y;
+
+    int ctr = state->ctr;
+#if defined(FONT_MONOSPACE) || defined(FONT_PACKED_INSTANCES)
+    // Y counts rows (and X columns with FONT_MONOSPACE), the vertex shader scales them by the glyph size
+    float height = 1.0;
+#else
+    float height = font.height;
+#endif
+#ifndef FONT_MONOSPACE
+    int *glyph_widths = font.glyph_widths;
+#endif
+    // float width_padded = font.width_padded;
+
+    // int *glyph_offsets = font.glyph_offsets;
+
+    // NULL when disabled, so the unkerned path only pays for a well predicted branch
+#ifdef FONT_MONOSPACE
+    signed char (*kerning)[NUM_GLYPHS] = NULL;
+#else
+    signed char (*kerning)[NUM_GLYPHS] = state->kerning ? font.kerning : NULL;
+#endif
+    int prev = state->prev;
+
+    int elastic = state->elastic;
+    int *col_width = state->col_width;
+    int cell = state->cell;
+
+    int align = state->align != FONT_ALIGN_LEFT;
+    int line_start = state->line_start; // first glyph of the current line
+
+    float max_width = state->max_width;
+    int lines = state->lines;
+    int line_open = state->line_open;
+
+    Font_Text_Index *index = state->index;
+
+    int markup = state->markup;
+    int color = state->color;
+
+    for (int i = begin; i < end; i++) {
+
+        // control chars never emit a glyph
+        if ((unsigned char)str[i] < 32) {
+            if (str[i] == FONT_ESC_CHAR && markup && i+1 < end && str[i+1] != '\n') {
+                // color markup, parsed here so there is no separate pass or color array.
+                // color is 9*palette + the color in it, a palette switch keeps the color
+                i++;
+                if (str[i] >= '0' && str[i] <= '8')
+                    color = color - color % 9 + str[i] - '0';
+                else if (str[i] >= 'A' && str[i] < 'A' + FONT_MAX_PALETTES)
+                    color = 9*(str[i] - 'A') + color % 9;
+                else if (str[i] == 'r')
+                    color = 0;
+                continue;
+            }
+
+            if (str[i] == '\n') {
+                if (align)
+                    font_align_line(state, glyphs, line_start, ctr, X, 0);
+                line_start = ctr;
+
+                if (elastic) {
+                    if (X > state->trailing[cell])
+                        state->trailing[cell] = X;
+                } else if (X > max_width) {
+                    max_width = X;
+                }
+                lines++;
+                line_open = 0;
+                if (index)
+                    font_index_add_line(index, ctr, i+1);
+
+                X = 0.0;
+                Y -= height;
+                cell = 0;
+                prev = -1;
+                continue;
+            }
+
+            line_open = 1;
+            if (str[i] == '\t') {
+                if (elastic && cell < FONT_MAX_TAB_COLUMNS-1) {
+                    if (X > col_width[cell])
+                        col_width[cell] = X;
+                    cell++;
+                    X = 0.0;
+                } else {
+                    // fixed stops, also for the cells of an elastic line past the last column
+                    X = font_next_tab_stop(&state->tabs, X*FONT_UNIT)/FONT_UNIT;
+                }
+            }
+            prev = -1;
+            continue;
+        }
+
+
+        int code_base = str[i]-32; // first glyph is ' ', i.e. ascii code 32
+        // float offset = glyph_offsets[code_base];
+#ifdef FONT_MONOSPACE
+        float width = 1.0;
+#else
+        float width = glyph_widths[code_base];
+#endif
+
+        // the kerning goes into the advance, so X still only takes one add per glyph
+        int kern = 0;
+        if (kerning && prev >= 0)
+            kern = kerning[prev][code_base];
+        prev = code_base;
+        line_open = 1;
+
+#ifdef FONT_PACKED_INSTANCES
+        // checked against the end of the glyph, as right alignment shifts it back by the line width
+        if (X + width + kern > FONT_PACKED_MAX || Y < -FONT_PACKED_MAX) {
+            state->overflow = 1;
+            break;
+        }
+#endif
+        float x1 = X + kern;
+        float y1 = Y;
+
+        Font_Glyph *g = &glyphs[ctr];
+        g->x = x1;
+        g->y = y1;
+        g->glyph = code_base;
+        g->color = col ? col[i] : color;
+        if (elastic)
+            tab_cells[ctr] = cell;
+        if (index)
+            index->glyph_chars[ctr] = i;
+
+        X += width + kern;
+        ctr++;
+    }
+
+    state->X = X;
+    state->Y = Y;
+    state->ctr = ctr;
+    state->prev = prev;
+    state->cell = cell;
+    state->line_start = line_start;
+    state->max_width = max_width;
+    state->lines = lines;
+    state->line_open = line_open;
+    state->color = color;
+}
+
+// aligns the last line, moves elastic cells into their columns, and finishes the bounds
+static void font_layout_end(Font_Layout_State *state, Font_Glyph *glyphs, unsigned char *tab_cells)
+{
+    if (state->align != FONT_ALIGN_LEFT && !state->overflow)
+        font_align_line(state, glyphs, state->line_start, state->ctr, state->X, 1);
+
+    if (state->line_open) {
+        if (state->elastic) {
+            if (state->X > state->trailing[state->cell])
+                state->trailing[state->cell] = state->X;
+        } else if (state->X > state->max_width) {
+            state->max_width = state->X;
+        }
+        state->lines++;
+        state->line_open = 0;
+    }
+
+    if (state->elastic) {
+        float col_start[FONT_MAX_TAB_COLUMNS];
+        float start = 0.0;
+        for (int c = 0; c < FONT_MAX_TAB_COLUMNS; c++) {
+            col_start[c] = start;
+            start += state->col_width[c] + font.glyph_widths[0]/FONT_UNIT;
+
+            // the widest line ends in the column where start + last cell is the largest
+            if (state->trailing[c] >= 0.0 && col_start[c] + state->trailing[c] > state->max_width)
+                state->max_width = col_start[c] + state->trailing[c];
+        }
+#ifdef FONT_PACKED_INSTANCES
+        if (state->max_width > FONT_PACKED_MAX)
+            state->overflow = 1;
+#endif
+        for (int k = 0; k < state->ctr && !state->overflow; k++) {
+            glyphs[k].x += col_start[tab_cells[k]];
+        }
+    }
+
+#ifdef FONT_PACKED_INSTANCES
+    if (state->overflow) {
+        printf("font_layout: more than %d lines or %d px wide doesn't fit FONT_PACKED_INSTANCES, nothing is drawn\n", FONT_PACKED_MAX, FONT_PACKED_MAX);
+        state->ctr = 0;
+    }
+#endif
+}
+
+static void font_layout_bounds(Font_Layout_State *state, Font_Bounds *bounds)
+{
+    bounds->width = (int)(state->max_width*FONT_UNIT);
+    bounds->height = state->lines*font.height;
+    bounds->lines = state->lines;
+    bounds->glyphs = state->ctr;
+}
+
+// program, uniforms and textures for drawing glyphs. only what changed is set
+static void font_draw_setup(GLuint program, Font_Uniforms *u, float offset[2], float size[2], float res[2])
+{
+    if (font.atlas_dirty)
+        font_atlas_flush();
+
+    font_use_program(program);
+    font_set_placement(u, offset, size, res);
+    font_colors_update();
+    font_bind_texture(0, font.texture_fontdata);
+    font_bind_texture(1, font.texture_metadata);
+    font_bind_vao();
+    font_set_blend(1);
+}
+
+// draws num_glyphs instances starting at first_glyph, from whatever buffer is bound to binding 1 of font.vao
+static void font_draw_instances(int first_glyph, int num_glyphs, float offset[2], float size[2], float res[2])
+{
+    font_draw_setup(font.program, &font.uniforms, offset, size, res);
+    glDrawArraysInstancedBaseInstance(GL_TRIANGLES, 0, 6, num_glyphs, first_glyph);
+    font.stats.draw_calls++;
+    //glFinish();
+}
+
+// draws the glyphs of a gpu layout, the instance count never comes back to the cpu
+static void font_draw_indirect(float offset[2], float size[2], float res[2])
+{
+    font_draw_setup(font.program, &font.uniforms, offset, size, res);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, font.buffer_command);
+    glDrawArraysIndirect(GL_TRIANGLES, 0);
+    font.stats.draw_calls++;
+}
+
+// one instance per char of the pulled string, the vertex shader does the layout
+static void font_draw_pulled(float offset[2], float size[2], float res[2])
+{
+#if defined(FONT_MONOSPACE) || defined(FONT_PACKED_INSTANCES)
+    float height = 1.0;
+#else
+    float height = font.height;
+#endif
+    Font_Uniforms *u = &font.uniforms_pull;
+    font_draw_setup(font.program_pull, u, offset, size, res);
+    font_set_pull(u, font.pull_lines, font.pull_colors, height);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, font.ssbo_text);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, font.ssbo_colors);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, font.ssbo_lines);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, font.ssbo_pull_x);
+    glDrawArraysInstanced(GL_TRIANGLES, 0, 6, font.pull_len);
+    font.stats.draw_calls++;
+}
+
+/*
+    Lays out str with compute_shader_layout.cs. Only the raw chars (and colors)
+    are uploaded, a quarter (packed: an eighth) of a byte per glyph byte written,
+    and the cpu never touches the glyphs.
+    Three dispatches: every chunk sums itself up, one workgroup scans the sums,
+    then every chunk writes its glyphs starting from what comes before it
+*/
+static void font_layout_gpu(char *str, char *col, int len)
+{
+    int num_chunks = font_layout_chunks(len);
+
+    font.text_glyph_data = font_stream_begin(len);
+#if defined(FONT_MONOSPACE) || defined(FONT_PACKED_INSTANCES)
+    float height = 1.0;
+#else
+    float height = font.height;
+#endif
+
+    glNamedBufferSubData(font.ssbo_text, 0, len, str);
+    if (col)
+        glNamedBufferSubData(font.ssbo_colors, 0, len, col);
+
+    Font_Uniforms *u = &font.uniforms_layout;
+    font_use_program(font.program_layout);
+    glUniform1i(u->len, len);
+    glUniform1i(u->has_colors, col != NULL);
+    glUniform1i(u->first_instance, font.first_instance);
+    glUniform1f(u->height, height);
+    font.stats.uniform_uploads += 4;
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, font.ssbo_text);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, font.ssbo_colors);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, font.vbo_code_instances);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, font.buffer_command);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, font.ssbo_chunks);
+    glUniform1i(u->pass, 0);
+    glDispatchCompute(num_chunks, 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    glUniform1i(u->pass, 1);
+    glDispatchCompute(1, 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    glUniform1i(u->pass, 2);
+    glDispatchCompute(num_chunks, 1, 1);
+    font.stats.draw_calls += 3;
+    font.stats.uniform_uploads += 3;
+    glMemoryBarrier(GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+
+    // there can't be more glyphs than chars
+    font_stream_end(len, 1);
+    font.ctr = 0;
+    font.index.num_lines = 0;
+    font.gpu_layout = 1;
+    font.pulled = 0;
+}
+
+/*
+    Only finds where the lines start, and without FONT_MONOSPACE the x of each 
+    char within its line, the vertex shader fetches each char from ssbo_text and 
+    places it. Uploads the chars, colors, one int per line and one float per char
+*/
+static void font_layout_pull(char *str, char *col, int len)
+{
+    if (!font.line_starts)
+        font.line_starts = (int*)malloc(sizeof(int)*(font.capacity + 1));
+
+    int num_lines = 0;
+    font.line_starts[num_lines++] = 0;
+#ifdef FONT_MONOSPACE
+    for (char *p = str; (p = (char*)memchr(p, '\n', len - (p - str))); p++) {
+        font.line_starts[num_lines++] = p - str + 1;
+    }
+#else
+    // a running sum per line, so an instance reads its x instead of adding up the glyphs before it
+    if (!font.pull_x)
+        font.pull_x = (float*)malloc(sizeof(float)*font.capacity);
+
+    float *pull_x = font.pull_x;
+    int *glyph_widths = font.glyph_widths;
+    float x = 0.0;
+    for (int i = 0; i < len; i++) {
+        unsigned char c = str[i];
+        pull_x[i] = x;
+        if (c == '\n') {
+            font.line_starts[num_lines++] = i + 1;
+            x = 0.0;
+        } else if (c >= 32 && c < 128) {
+            x += glyph_widths[c - 32];
+        }
+    }
+    glNamedBufferSubData(font.ssbo_pull_x, 0, sizeof(float)*len, pull_x);
+#endif
+
+    glNamedBufferSubData(font.ssbo_text, 0, len, str);
+    if (col)
+        glNamedBufferSubData(font.ssbo_colors, 0, len, col);
+    glNamedBufferSubData(font.ssbo_lines, 0, sizeof(int)*num_lines, font.line_starts);
+
+    font.pull_len = len;
+    font.pull_lines = num_lines;
+    font.ctr = 0;
+    font.index.num_lines = 0;
+    font.gpu_layout = 0;
+    font.pull_colors = col != NULL;
+    font.pulled = 1;
+}
+
+/*
+    Makes room for layouts of up to max_glyphs glyphs. The capacity doubles until
+    it fits, so growing is rare. font_layout calls this as needed, call it up front
+    to avoid growing in the middle of a frame.
+
+    The last layout is carried over to the new storage, see font_stream_rebuild
+*/
+void font_reserve(int max_glyphs)
+{
+    if (font.initialized == 0)
+    {
+        font_init();
+    }
+
+    if (max_glyphs <= font.capacity)
+        return;
+
+    int capacity = font.capacity;
+    while (capacity < max_glyphs) {
+        capacity *= 2;
+    }
+    font.stats.storage_grows++;
+
+    // font_stream_begin goes by font.capacity
+    font.capacity = capacity;
+    font_stream_rebuild(font.stream, capacity);
+
+    glNamedBufferData(font.ssbo_text, (capacity + 3) & ~3, NULL, GL_DYNAMIC_DRAW);
+    glNamedBufferData(font.ssbo_colors, (capacity + 3) & ~3, NULL, GL_DYNAMIC_DRAW);
+    glNamedBufferData(font.ssbo_chunks, 4*sizeof(GLuint)*font_layout_chunks(capacity), NULL, GL_DYNAMIC_DRAW);
+    glNamedBufferData(font.ssbo_lines, sizeof(int)*(capacity + 1), NULL, GL_DYNAMIC_DRAW);
+    glNamedBufferData(font.ssbo_pull_x, sizeof(float)*capacity, NULL, GL_DYNAMIC_DRAW);
+    if (font.line_starts)
+        font.line_starts = (int*)realloc(font.line_starts, sizeof(int)*(capacity + 1));
+    if (font.pull_x)
+        font.pull_x = (float*)realloc(font.pull_x, sizeof(float)*capacity);
+
+    if (font.tab_cells)
+        font.tab_cells = (unsigned char*)realloc(font.tab_cells, capacity);
+    if (font.index.glyph_chars)
+        font.index.glyph_chars = (int*)realloc(font.index.glyph_chars, sizeof(int)*capacity);
+}
+
+// most glyphs laid out by a single font_layout call so far
+int font_high_water_mark()
+{
+    return font.high_water;
+}
+
+/*
+    Lays out and uploads str, without drawing it. bounds (can be NULL) gets the
+    size of the string as a by-product, so the caller can decide where to put it
+    and then call font_draw_layout, without walking the string a second time
+*/
+void font_layout(char *str, char *col, Font_Bounds *bounds) 
+{
+    if (font.initialized == 0)
+    {
+        font_init();
+    }
+
+    // Update/Upload
+    // there can't be more glyphs than chars
+    int len = strlen(str);
+    font_reserve(len);
+
+    // the shaders only know plain left aligned text, and the bounds would need a read back
+    if (!bounds && !font.kerning_enabled && font.align == FONT_ALIGN_LEFT && 
+        !font.tab_elastic && !font.markup_enabled && !font.hit_index_enabled) {
+        if (font.vertex_pulling_enabled) {
+            font_layout_pull(str, col, len);
+            return;
+        }
+        if (font.gpu_layout_enabled && len <= FONT_LAYOUT_MAX_CHARS) {
+            font_layout_gpu(str, col, len);
+            return;
+        }
+    }
+    font.gpu_layout = 0;
+    font.pulled = 0;
+
+    // with the persistent streams layout writes directly into mapped memory, there is no separate upload.
+    // the ring is mapped write only though, so alignment, elastic tabs and hit testing, which read 
+    // the glyphs back, lay out into staging, and the result is copied into the ring in one go
+    Font_Glyph *glyphs = font_stream_begin(len);
+    int read_back = font.align != FONT_ALIGN_LEFT || font.tab_elastic || font.hit_index_enabled;
+    font.text_glyph_data = font.ring && read_back ? font.staging : glyphs;
+
+    if (font.tab_elastic && !font.tab_cells) {
+        font.tab_cells = (unsigned char*)malloc(font.capacity);
+    }
+
+    Font_Layout_State state;
+    font_layout_begin(&state);
+    if (font.hit_index_enabled) {
+        font_index_reset(&font.index, font.capacity);
+        state.index = &font.index;
+    } else {
+        font.index.num_lines = 0;
+    }
+    font_layout_run(&state, str, col, 0, len, font.text_glyph_data, font.tab_cells);
+    font_layout_end(&state, font.text_glyph_data, font.tab_cells);
+    int ctr = state.ctr;
+
+    if (bounds)
+        font_layout_bounds(&state, bounds);
+
+    if (ctr > font.high_water)
+        font.high_water = ctr;
+
+    // actual uploading
+    if (font.text_glyph_data != glyphs)
+        memcpy(glyphs, font.text_glyph_data, sizeof(Font_Glyph)*ctr);
+    font_stream_end(ctr, 0);
+    font.ctr = ctr;
+}
+
+/*
+    Replaces the w x h pixels at (x, y) of the atlas, in texture space (rows bottom up).
+    pixels is w bytes per row, NULL if atlas_pixels was changed in place.
+    Nothing is uploaded here, the change is merged into a dirty rect that the
+    next draw hands to font_atlas_flush. New glyphs also need their metadata
+*/
+void font_atlas_update(int x, int y, int w, int h, const unsigned char *pixels)
+{
+    if (pixels) {
+        for (int j = 0; j < h; j++) {
+            memcpy(font.atlas_pixels + (y + j)*font.width_padded + x, pixels + j*w, w);
+        }
+    }
+
+    if (!font.atlas_dirty) {
+        font.atlas_x0 = x;
+        font.atlas_y0 = y;
+        font.atlas_x1 = x + w;
+        font.atlas_y1 = y + h;
+    } else {
+        if (x < font.atlas_x0) font.atlas_x0 = x;
+        if (y < font.atlas_y0) font.atlas_y0 = y;
+        if (x + w > font.atlas_x1) font.atlas_x1 = x + w;
+        if (y + h > font.atlas_y1) font.atlas_y1 = y + h;
+    }
+    font.atlas_dirty = 1;
+}
+
+/*
+    Uploads the dirty rect of the atlas through the next pbo of the ring. The
+    copy into the texture happens on the gpu, after the draws already queued.
+    Never waits: if the pbo is still being read from, the rect stays dirty 
+    and the draw uses the old atlas for one more frame. Returns 1 if it uploaded
+*/
+int font_atlas_flush()
+{
+    if (!font.atlas_dirty)
+        return 0;
+
+    int slot = font.atlas_slot;
+    GLsync fence = font.atlas_fences[slot];
+    if (fence) {
+        if (glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+            return 0;
+        glDeleteSync(fence);
+        font.atlas_fences[slot] = 0;
+    }
+
+    int x = font.atlas_x0;
+    int y = font.atlas_y0;
+    int w = font.atlas_x1 - x;
+    int h = font.atlas_y1 - y;
+    size_t slot_offset = (size_t)slot*font.width_padded*font.height;
+    unsigned char *dst = font.atlas_pbo_data + slot_offset;
+    for (int j = 0; j < h; j++) {
+        memcpy(dst + j*w, font.atlas_pixels + (y + j)*font.width_padded + x, w);
+    }
+
+    // the rows are packed tightly, w bytes each
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, font.atlas_pbo);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTextureSubImage2D(font.texture_fontdata, 0, x, y, w, h, GL_RED, GL_UNSIGNED_BYTE, (void*)slot_offset);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    font.atlas_fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    font.atlas_slot = (slot + 1) % FONT_ATLAS_PBOS;
+    font.atlas_dirty = 0;
+    return 1;
+}
+
+/*
+    Switches to another way of streaming glyphs to the gpu, see Font_Stream.
+    Recreates the instance vbo, so it's meant for startup or settings, not every frame
+*/
+void font_set_stream(Font_Stream stream)
+{
+    if (font.initialized == 0)
+    {
+        font_init();
+    }
+
+    if (stream != font.stream)
+        font_stream_rebuild(stream, font.capacity);
+}
+
+/*
+    Times every Font_Stream on this driver, and keeps the fastest. Each lays out 
+    and draws str iterations times with the rasterizer off, then waits for the gpu.
+    The diff in SubData is defeated, so all of them stream every glyph.
+    The gpu layouts are off meanwhile, since they skip the stream. 
+    Prints the timings, and returns the stream it picked
+*/
+Font_Stream font_benchmark_streams(char *str, int iterations)
+{
+    if (font.initialized == 0)
+    {
+        font_init();
+    }
+
+    int gpu_layout_enabled = font.gpu_layout_enabled;
+    int vertex_pulling_enabled = font.vertex_pulling_enabled;
+    font.gpu_layout_enabled = 0;
+    font.vertex_pulling_enabled = 0;
+
+    float offset[2] = {0.0, 0.0};
+    float one[2] = {1.0, 1.0};
+    Font_Stream best = font.stream;
+    double best_time = 1e30;
+
+    glEnable(GL_RASTERIZER_DISCARD);
+    for (int s = 0; s < FONT_STREAM_COUNT; s++) {
+        font_set_stream((Font_Stream)s);
+
+        // warm up, the first layout may allocate
+        font_layout(str, NULL, NULL);
+        font_draw_layout(offset, one, one);
+        glFinish();
+
+        double t0 = glfwGetTime();
+        for (int i = 0; i < iterations; i++) {
+            font.shadow_len = 0;
+            font_layout(str, NULL, NULL);
+            font_draw_layout(offset, one, one);
+        }
+        glFinish();
+        double t = (glfwGetTime() - t0)/iterations;
+
+        printf("%-24s %9.1f us per layout\n", font_stream_names[s], t*1e6); fflush(stdout);
+        if (t < best_time) {
+            best_time = t;
+            best = (Font_Stream)s;
+        }
+    }
+    glDisable(GL_RASTERIZER_DISCARD);
+
+    font_set_stream(best);
+    font.gpu_layout_enabled = gpu_layout_enabled;
+    font.vertex_pulling_enabled = vertex_pulling_enabled;
+    printf("Streaming with %s\n", font_stream_names[best]); fflush(stdout);
+    return best;
+}
+
+/*
+    Lays out strings on the gpu instead, see compute_shader_layout.cs. 
+    Only used for left aligned strings without kerning, markup, elastic tabs, 
+    hit testing or bounds, anything else still takes the cpu path.
+    Tabs don't advance, like the other control chars.
+    Strings longer than FONT_LAYOUT_MAX_CHARS are laid out on the cpu as well.
+    Needs compute shaders, which Mesa's llvmpipe has as well (LIBGL_ALWAYS_SOFTWARE=1)
+*/
+void font_set_gpu_layout(int enabled)
+{
+    font.gpu_layout_enabled = enabled;
+}
+
+/*
+    Draws strings without any per glyph data, see FONT_PULL in vertex_shader_text.vs. 
+    The cpu only builds a table of line starts, each instance fetches its own char.
+    With FONT_MONOSPACE x is just the column, otherwise the cpu also keeps a running 
+    sum of the widths along each line, so every instance costs the same.
+    Same restrictions as font_set_gpu_layout (which it takes precedence over), 
+    and with FONT_MONOSPACE control chars other than newlines take up a column
+*/
+void font_set_vertex_pulling(int enabled)
+{
+    font.vertex_pulling_enabled = enabled;
+}
+
+void font_set_hit_index(int enabled)
+{
+    font.hit_index_enabled = enabled;
+}
+
+/*
+    With markup enabled, FONT_ESC followed by a digit '0'-'8' sets the color of the
+    following glyphs, FONT_ESC followed by a letter 'A'-'H' the palette they take 
+    it from, and FONT_ESC 'r' resets both. Palette 'A' stands for the string's own
+    palette in a batch (Font_String_Params.palette), the others replace it.
+    Both bytes are skipped by layout and measurement. An explicit color array 
+    passed to font_draw still takes precedence
+*/
+void font_set_markup(int enabled)
+{
+    if (font.markup_enabled != enabled)
+        font_measure_cache_clear();
+    font.markup_enabled = enabled;
+}
+
+/*
+    Char offset in the string last laid out by font_layout closest to the window 
+    coordinates (x, y), or -1 if the index wasn't built. offset, size and res 
+    are what the string was (or will be) drawn with
+*/
+int font_hit_test(double x, double y, float offset[2], float size[2], float res[2])
+{
+    return font_index_query(&font.index, font.text_glyph_data, font.ctr, x, y, offset, size, res);
+}
+
+/*
+    Highlights the chars [begin, end) of the string last laid out by font_layout
+    (with the hit index enabled) in palette color 'color'. Only the rects added
+    since the last draw are uploaded, so add ranges as they change
+*/
+void font_highlights_add(Font_Highlights *h, int begin, int end, int color)
+{
+    font_index_highlight(h, &font.index, font.text_glyph_data, font.ctr, begin, end, color);
+}
+
+void font_highlights_clear(Font_Highlights *h)
+{
+    h->count = 0;
+    h->uploaded = 0;
+}
+
+// draws all the rects with a single instanced draw, call before drawing the text on top
+void font_highlights_draw(Font_Highlights *h, float offset[2], float size[2], float res[2])
+{
+    if (h->count == 0)
+        return;
+
+    if (!h->vbo) 
+        glCreateBuffers(1, &h->vbo);
+
+    if (h->count > h->vbo_capacity) {
+        h->vbo_capacity = h->capacity;
+        glNamedBufferData(h->vbo, sizeof(float)*4*h->vbo_capacity, NULL, GL_DYNAMIC_DRAW);
+        h->uploaded = 0;
+    }
+
+    if (h->uploaded < h->count) {
+        glNamedBufferSubData(h->vbo, sizeof(float)*4*h->uploaded, sizeof(float)*4*(h->count - h->uploaded), h->rects + 4*h->uploaded);
+        h->uploaded = h->count;
+    }
+
+    Font_Uniforms *u = &font.uniforms_rect;
+    font_use_program(font.program_rect);
+    if (!u->placement_valid) {
+        // the font height never changes
+        glUniform1f(u->line_height, font.height);
+        font.stats.uniform_uploads++;
+    }
+    font_set_placement(u, offset, size, res);
+    font_colors_update();
+    font_bind_vao();
+    font_set_blend(0);
+
+    glVertexArrayVertexBuffer(font.vao, 2, h->vbo, 0, 4*sizeof(float));
+    glEnableVertexArrayAttrib(font.vao, 2);
+    glDrawArraysInstanced(GL_TRIANGLES, 0, 6, h->count);
+    font.stats.draw_calls++;
+    glDisableVertexArrayAttrib(font.vao, 2);
+}
+
+void font_highlights_free(Font_Highlights *h)
+{
+    if (h->vbo)
+        glDeleteBuffers(1, &h->vbo);
+    free(h->rects);
+    memset(h, 0, sizeof(*h));
+}
+
+// marks glyphs as belonging to string, for font_tagged_begin
+static void font_glyphs_tag(Font_Glyph *glyphs, int num_glyphs, int string)
+{
+    for (int k = 0; k < num_glyphs; k++) {
+#ifdef FONT_PACKED_INSTANCES
+        glyphs[k].flags = (unsigned short)string;
+#else
+        glyphs[k].color += 256.0f*string;
+#endif
+    }
+}
+
+// makes room for more glyphs, strings and commands
+static void font_context_reserve(Font_Context *ctx, int glyphs, int strings, int commands)
+{
+    if (ctx->num_glyphs + glyphs > ctx->max_glyphs) {
+        ctx->max_glyphs = ctx->max_glyphs ? 2*ctx->max_glyphs : 4096;
+        if (ctx->max_glyphs < ctx->num_glyphs + glyphs)
+            ctx->max_glyphs = ctx->num_glyphs + glyphs;
+        ctx->glyphs = (Font_Glyph*)realloc(ctx->glyphs, sizeof(Font_Glyph)*ctx->max_glyphs);
+    }
+    if (ctx->num_strings + strings > ctx->max_strings) {
+        ctx->max_strings = ctx->max_strings ? 2*ctx->max_strings : 64;
+        if (ctx->max_strings < ctx->num_strings + strings)
+            ctx->max_strings = ctx->num_strings + strings;
+        ctx->params = (Font_String_Params*)realloc(ctx->params, sizeof(Font_String_Params)*ctx->max_strings);
+    }
+    if (ctx->num_commands + commands > ctx->max_commands) {
+        ctx->max_commands = ctx->max_commands ? 2*ctx->max_commands : 64;
+        if (ctx->max_commands < ctx->num_commands + commands)
+            ctx->max_commands = ctx->num_commands + commands;
+        ctx->commands = (Font_Command*)realloc(ctx->commands, sizeof(Font_Command)*ctx->max_commands);
+    }
+}
+
+static Font_Command *font_command_push(Font_Context *ctx, Font_Command_Kind kind)
+{
+    font_context_reserve(ctx, 0, 0, 1);
+
+    Font_Command *c = &ctx->commands[ctx->num_commands];
+    memset(c, 0, sizeof(*c));
+    c->key = (unsigned long long)(ctx->layer & 0xFFFF) << 48 | (unsigned long long)kind << 40 | (unsigned)ctx->num_commands;
+    ctx->num_commands++;
+    return c;
+}
+
+// lays out str at the end of ctx, touches nothing but ctx
+static void font_context_record(Font_Context *ctx, char *str, char *col, const Font_String_Params *params)
+{
+    int len = strlen(str);
+    font_context_reserve(ctx, len, 1, 0);
+    if (ctx->options.tab_elastic && len > ctx->max_tab_cells) {
+        ctx->max_tab_cells = len;
+        ctx->tab_cells = (unsigned char*)realloc(ctx->tab_cells, ctx->max_tab_cells);
+    }
+
+    Font_Glyph *glyphs = ctx->glyphs + ctx->num_glyphs;
+    Font_Layout_State state;
+    font_layout_begin_options(&state, &ctx->options);
+    font_layout_run(&state, str, col, 0, len, glyphs, ctx->tab_cells);
+    font_layout_end(&state, glyphs, ctx->tab_cells);
+
+    // tagged at font_flush, once the strings are in key order
+    Font_Command *c = font_command_push(ctx, FONT_COMMAND_TEXT);
+    c->first = ctx->num_glyphs;
+    c->count = state.ctr;
+    c->string = ctx->num_strings;
+
+    ctx->params[ctx->num_strings] = *params;
+    ctx->num_glyphs += state.ctr;
+    ctx->num_strings++;
+}
+
+// lays out str at the end of the batch, with the current layout options
+static void font_batch_add(char *str, char *col, const Font_String_Params *params)
+{
+    if (font.initialized == 0)
+    {
+        font_init();
+    }
+
+    Font_Context *ctx = &font.batch.context;
+    if (ctx->num_strings == FONT_MAX_BATCH_STRINGS)
+        font_flush();
+
+    font_layout_options(&ctx->options);
+    font_context_record(ctx, str, col, params);
+}
+
+// draws whatever was last laid out by font_layout
+void font_draw_layout(float offset[2], float size[2], float res[2])
+{
+    if (font.gpu_layout) {
+        font_draw_indirect(offset, size, res);
+        return;
+    }
+    if (font.pulled) {
+        font_draw_pulled(offset, size, res);
+        return;
+    }
+    font_draw_instances(font.first_instance, font.ctr, offset, size, res);
+}
+
+void font_draw(char *str, char *col, float offset[2], float size[2], float res[2]) 
+{
+    if (font.batch.enabled) {
+        Font_String_Params params;
+        font_params_init(&params, offset, size, res);
+        font_batch_add(str, col, &params);
+        return;
+    }
+    font_layout(str, col, NULL);
+    font_draw_layout(offset, size, res);
+}
+
+/*
+    Like font_draw, but with all of Font_String_Params. Always goes through the
+    batch, without batching on it's flushed right away
+*/
+void font_draw_params(char *str, char *col, const Font_String_Params *params)
+{
+    font_batch_add(str, col, params);
+    if (!font.batch.enabled)
+        font_flush();
+}
+
+// what font_draw uses: no clipping, palette 0, z = 0
+void font_params_init(Font_String_Params *params, float offset[2], float size[2], float res[2])
+{
+    memset(params, 0, sizeof(*params));
+    params->offset[0] = offset[0];
+    params->offset[1] = offset[1];
+    params->size[0] = size[0];
+    params->size[1] = size[1];
+    params->clip[0] = -1e30f;
+    params->clip[1] = -1e30f;
+    params->clip[2] = 1e30f;
+    params->clip[3] = 1e30f;
+    params->resolution[0] = res[0];
+    params->resolution[1] = res[1];
+}
+
+// sets the 9 rgb colors of palette, which batched strings select with Font_String_Params.palette
+void font_set_palette(int palette, const float *rgb)
+{
+    if (palette < 0 || palette >= FONT_MAX_PALETTES) {
+        printf("font_set_palette: palette %d out of range, there are %d\n", palette, FONT_MAX_PALETTES);
+        return;
+    }
+    memcpy(font.palettes[palette], rgb, sizeof(font.palettes[palette]));
+    if (palette == 0)
+        memcpy(colors, rgb, sizeof(colors));
+    font.colors_dirty = 1;
+}
+
+/*
+    With batching on, font_draw only lays the string out, and everything is drawn
+    by the next font_flush, by layer and then in the order it was added. Turning 
+    it off flushes. Batched strings always take the cpu layout, and can't be hit tested
+*/
+void font_set_batching(int enabled)
+{
+    if (!enabled)
+        font_flush();
+    font.batch.enabled = enabled;
+}
+
+// batched draws from now on go to layer (0-65535), higher layers are drawn on top
+void font_set_layer(int layer)
+{
+    font.batch.context.layer = layer;
+}
+
+/*
+    Like font_highlights_draw, but with batching on the rects are drawn by font_flush,
+    under the text of the current layer. h has to stay alive until then
+*/
+void font_highlights_submit(Font_Highlights *h, float offset[2], float size[2], float res[2])
+{
+    if (!font.batch.enabled) {
+        font_highlights_draw(h, offset, size, res);
+        return;
+    }
+
+    Font_Command *c = font_command_push(&font.batch.context, FONT_COMMAND_RECTS);
+    c->highlights = h;
+    c->placement[0] = offset[0];
+    c->placement[1] = offset[1];
+    c->placement[2] = size[0];
+    c->placement[3] = size[1];
+    c->placement[4] = res[0];
+    c->placement[5] = res[1];
+}
+
+/*
+    Sets up for drawing tagged glyphs from vbo, which are placed by the 
+    Font_String_Params in ssbo_params. Draw, then font_tagged_end
+*/
+static void font_tagged_begin(GLuint vbo, GLuint ssbo_params)
+{
+    float zero[2] = {0.0, 0.0};
+    font_draw_setup(font.program_batch, &font.uniforms_batch, zero, zero, zero);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, ssbo_params);
+    glVertexArrayVertexBuffer(font.vao, 1, vbo, 0, sizeof(Font_Glyph));
+    for (int i = 0; i < 4; i++) {
+        glEnable(GL_CLIP_DISTANCE0 + i);
+    }
+}
+
+static void font_tagged_end()
+{
+    for (int i = 0; i < 4; i++) {
+        glDisable(GL_CLIP_DISTANCE0 + i);
+    }
+    glVertexArrayVertexBuffer(font.vao, 1, font.vbo_code_instances, 0, sizeof(Font_Glyph));
+}
+
+static int font_command_cmp(const void *x, const void *y)
+{
+    unsigned long long a = ((const Font_Command*)x)->key;
+    unsigned long long b = ((const Font_Command*)y)->key;
+    return (a > b) - (a < b);
+}
+
+/*
+    Sorts everything batched since the last flush by key, uploads the strings
+    in that order, and draws each run of consecutive text commands in one call.
+    Without highlights in between that's one draw for all layers.
+    Call it at the end of every frame, it also fences the frame's part of the ring
+*/
+void font_flush()
+{
+    Font_Batch *b = &font.batch;
+    Font_Context *ctx = &b->context;
+    if (ctx->num_commands == 0) {
+        font_ring_fence();
+        return;
+    }
+
+    if (!b->vbo) {
+        glCreateBuffers(1, &b->vbo);
+        glCreateBuffers(1, &b->ssbo_params);
+    }
+
+    qsort(ctx->commands, ctx->num_commands, sizeof(Font_Command), font_command_cmp);
+
+    if (b->max_sorted < ctx->max_glyphs) {
+        b->max_sorted = ctx->max_glyphs;
+        b->sorted = (Font_Glyph*)realloc(b->sorted, sizeof(Font_Glyph)*b->max_sorted);
+    }
+    if (b->max_sorted_params < ctx->max_strings) {
+        b->max_sorted_params = ctx->max_strings;
+        b->sorted_params = (Font_String_Params*)realloc(b->sorted_params, sizeof(Font_String_Params)*b->max_sorted_params);
+    }
+
+    // the strings are renumbered in key order, so each run is contiguous
+    int num_glyphs = 0;
+    int num_strings = 0;
+    for (int i = 0; i < ctx->num_commands; i++) {
+        Font_Command *c = &ctx->commands[i];
+        if (c->highlights)
+            continue;
+        memcpy(b->sorted + num_glyphs, ctx->glyphs + c->first, sizeof(Font_Glyph)*c->count);
+        font_glyphs_tag(b->sorted + num_glyphs, c->count, num_strings);
+        b->sorted_params[num_strings] = ctx->params[c->string];
+        c->first = num_glyphs;
+        num_glyphs += c->count;
+        num_strings++;
+    }
+
+    if (num_strings > 0) {
+        // orphaned every flush, so there's never a wait on last frame's draw
+        glNamedBufferData(b->vbo, sizeof(Font_Glyph)*b->max_sorted, NULL, GL_STREAM_DRAW);
+        glNamedBufferSubData(b->vbo, 0, sizeof(Font_Glyph)*num_glyphs, b->sorted);
+        glNamedBufferData(b->ssbo_params, sizeof(Font_String_Params)*num_strings, b->sorted_params, GL_STREAM_DRAW);
+    }
+
+    int i = 0;
+    while (i < ctx->num_commands) {
+        Font_Command *c = &ctx->commands[i];
+        if (c->highlights) {
+            font_highlights_draw(c->highlights, c->placement, c->placement + 2, c->placement + 4);
+            i++;
+            continue;
+        }
+
+        // merged with all the text commands that follow
+        int first = c->first;
+        int count = 0;
+        while (i < ctx->num_commands && !ctx->commands[i].highlights) {
+            count += ctx->commands[i].count;
+            i++;
+        }
+        if (count > 0) {
+            font_tagged_begin(b->vbo, b->ssbo_params);
+            glDrawArraysInstancedBaseInstance(GL_TRIANGLES, 0, 6, count, first);
+            font.stats.draw_calls++;
+            font_tagged_end();
+        }
+    }
+
+    ctx->num_glyphs = 0;
+    ctx->num_strings = 0;
+    ctx->num_commands = 0;
+    font_ring_fence();
+}
+
+/*
+    Recording from worker threads
+
+    Call font_context_init on the render thread (it needs the font loaded), 
+    then each worker records into its own context with font_context_draw, which
+    takes no locks and makes no gl calls. Once the workers are done, the render
+    thread hands every context to font_context_submit and calls font_flush,
+    which uploads all of them at once. Contexts submitted earlier are drawn 
+    first within a layer, so the result doesn't depend on thread timing.
+    A context takes the font's layout options at font_context_init and keeps its
+    own copy, changed with the font_context_set_* calls, so the font_set_* calls
+    are free to run meanwhile. Only loading a font or kerning table has to wait 
+    until the workers are done
+*/
+void font_context_init(Font_Context *ctx)
+{
+    if (font.initialized == 0)
+    {
+        font_init();
+    }
+
+    memset(ctx, 0, sizeof(*ctx));
+    font_layout_options(&ctx->options);
+}
+
+void font_context_set_layer(Font_Context *ctx, int layer)
+{
+    ctx->layer = layer;
+}
+
+void font_context_set_align(Font_Context *ctx, Font_Align align, int align_width)
+{
+    ctx->options.align = align;
+    ctx->options.align_width = align_width;
+}
+
+void font_context_set_markup(Font_Context *ctx, int enabled)
+{
+    ctx->options.markup = enabled;
+}
+
+// like font_set_tabs, for the strings recorded into ctx from now on
+void font_context_set_tabs(Font_Context *ctx, int tab_width, const int *stops, int num_stops, int elastic)
+{
+    font_tabs_init(&ctx->options.tabs, tab_width, stops, num_stops);
+    ctx->options.tab_elastic = elastic;
+}
+
+void font_context_set_kerning(Font_Context *ctx, int enabled)
+{
+#ifdef FONT_MONOSPACE
+    enabled = 0;
+#endif
+    ctx->options.kerning = enabled;
+}
+
+void font_context_draw(Font_Context *ctx, char *str, char *col, const Font_String_Params *params)
+{
+    if (ctx->num_strings == FONT_MAX_BATCH_STRINGS) {
+        printf("font_context_draw: more than %d strings, submit more often\n", FONT_MAX_BATCH_STRINGS);
+        return;
+    }
+    font_context_record(ctx, str, col, params);
+}
+
+// appends everything recorded in ctx to the batch, and empties ctx. render thread only
+void font_context_submit(Font_Context *ctx)
+{
+    Font_Context *batch = &font.batch.context;
+    if (batch->num_strings + ctx->num_strings > FONT_MAX_BATCH_STRINGS)
+        font_flush();
+
+    font_context_reserve(batch, ctx->num_glyphs, ctx->num_strings, ctx->num_commands);
+    memcpy(batch->glyphs + batch->num_glyphs, ctx->glyphs, sizeof(Font_Glyph)*ctx->num_glyphs);
+    memcpy(batch->params + batch->num_strings, ctx->params, sizeof(Font_String_Params)*ctx->num_strings);
+    for (int i = 0; i < ctx->num_commands; i++) {
+        // sequenced after what's already in the batch
+        Font_Command *c = &batch->commands[batch->num_commands];
+        *c = ctx->commands[i];
+        c->key = (c->key & ~0xFFFFFFFFull) | (unsigned)batch->num_commands;
+        c->first += batch->num_glyphs;
+        c->string += batch->num_strings;
+        batch->num_commands++;
+    }
+    batch->num_glyphs += ctx->num_glyphs;
+    batch->num_strings += ctx->num_strings;
+
+    ctx->num_glyphs = 0;
+    ctx->num_strings = 0;
+    ctx->num_commands = 0;
+}
+
+void font_context_free(Font_Context *ctx)
+{
+    free(ctx->glyphs);
+    free(ctx->params);
+    free(ctx->commands);
+    free(ctx->tab_cells);
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+// puts [offset, offset+size) back in the free list, merged with the ranges it touches
+static void font_arena_release(Font_Arena *a, int offset, int size)
+{
+    int i = 0;
+    while (i < a->num_free && a->free[i].offset < offset) {
+        i++;
+    }
+
+    int merge_prev = i > 0 && a->free[i-1].offset + a->free[i-1].size == offset;
+    int merge_next = i < a->num_free && offset + size == a->free[i].offset;
+    if (merge_prev && merge_next) {
+        a->free[i-1].size += size + a->free[i].size;
+        memmove(&a->free[i], &a->free[i+1], sizeof(Font_Arena_Range)*(a->num_free - i - 1));
+        a->num_free--;
+    } else if (merge_prev) {
+        a->free[i-1].size += size;
+    } else if (merge_next) {
+        a->free[i].offset = offset;
+        a->free[i].size += size;
+    } else {
+        if (a->num_free == a->max_free) {
+            a->max_free = a->max_free ? 2*a->max_free : 64;
+            a->free = (Font_Arena_Range*)realloc(a->free, sizeof(Font_Arena_Range)*a->max_free);
+        }
+        memmove(&a->free[i+1], &a->free[i], sizeof(Font_Arena_Range)*(a->num_free - i));
+        a->free[i].offset = offset;
+        a->free[i].size = size;
+        a->free[i].count = 0;
+        a->num_free++;
+    }
+}
+
+// first fit, returns the offset or -1
+static int font_arena_take(Font_Arena *a, int size)
+{
+    for (int i = 0; i < a->num_free; i++) {
+        if (a->free[i].size >= size) {
+            int offset = a->free[i].offset;
+            a->free[i].offset += size;
+            a->free[i].size -= size;
+            if (a->free[i].size == 0) {
+                memmove(&a->free[i], &a->free[i+1], sizeof(Font_Arena_Range)*(a->num_free - i - 1));
+                a->num_free--;
+            }
+            return offset;
+        }
+    }
+    return -1;
+}
+
+// doubles the buffer, the ranges keep their offsets
+static void font_arena_grow(Font_Arena *a, int min_capacity)
+{
+    int capacity = a->capacity ? a->capacity : FONT_ARENA_INITIAL;
+    while (capacity < min_capacity) {
+        capacity *= 2;
+    }
+
+    GLuint vbo;
+    glCreateBuffers(1, &vbo);
+    glNamedBufferData(vbo, sizeof(Font_Glyph)*capacity, NULL, GL_STATIC_DRAW);
+    if (a->vbo) {
+        glCopyNamedBufferSubData(a->vbo, vbo, 0, 0, sizeof(Font_Glyph)*a->capacity);
+        glDeleteBuffers(1, &a->vbo);
+    }
+    a->vbo = vbo;
+
+    font_arena_release(a, a->capacity, capacity - a->capacity);
+    a->capacity = capacity;
+}
+
+/*
+    Reserves room for num_glyphs glyphs in the arena, returns a handle for
+    font_arena_upload/draw/free. When nothing fits, the arena is compacted if 
+    that would help, and grown otherwise
+*/
+int font_arena_alloc(int num_glyphs)
+{
+    Font_Arena *a = &font.arena;
+    if (num_glyphs < 1)
+        num_glyphs = 1;
+
+    int offset = font_arena_take(a, num_glyphs);
+    if (offset < 0 && a->capacity - a->used >= num_glyphs) {
+        font_arena_compact();
+        offset = font_arena_take(a, num_glyphs);
+    }
+    if (offset < 0) {
+        // the new space joins the free range at the end, if any, so only the rest is needed
+        int tail = 0;
+        if (a->num_free > 0 && a->free[a->num_free-1].offset + a->free[a->num_free-1].size == a->capacity)
+            tail = a->free[a->num_free-1].size;
+        font_arena_grow(a, a->capacity + num_glyphs - tail);
+        offset = font_arena_take(a, num_glyphs);
+        assert(offset >= 0);
+    }
+
+    int handle;
+    if (a->num_free_handles > 0) {
+        handle = a->free_handles[--a->num_free_handles];
+    } else {
+        if (a->num_ranges == a->max_ranges) {
+            a->max_ranges = a->max_ranges ? 2*a->max_ranges : 64;
+            a->ranges = (Font_Arena_Range*)realloc(a->ranges, sizeof(Font_Arena_Range)*a->max_ranges);
+            a->free_handles = (int*)realloc(a->free_handles, sizeof(int)*a->max_ranges);
+        }
+        handle = a->num_ranges++;
+    }
+
+    a->ranges[handle].offset = offset;
+    a->ranges[handle].size = num_glyphs;
+    a->ranges[handle].count = 0;
+    a->used += num_glyphs;
+    return handle;
+}
+
+// copies num_glyphs glyphs (no more than were allocated) into the range of handle
+void font_arena_upload(int handle, const Font_Glyph *glyphs, int num_glyphs)
+{
+    Font_Arena_Range *r = &font.arena.ranges[handle];
+    if (num_glyphs > r->size)
+        num_glyphs = r->size;
+
+    glNamedBufferSubData(font.arena.vbo, sizeof(Font_Glyph)*r->offset, sizeof(Font_Glyph)*num_glyphs, glyphs);
+    r->count = num_glyphs;
+}
 
-void font_string_dimensions(char *str, int *width, int *height)
+// 0 when all free glyphs are in one range, towards 1 the more they're scattered
+float font_arena_fragmentation()
 {
-    *width = 0;
-    *height = 0;
+    Font_Arena *a = &font.arena;
+    int total = 0;
+    int largest = 0;
+    for (int i = 0; i < a->num_free; i++) {
+        total += a->free[i].size;
+        if (a->free[i].size > largest)
+            largest = a->free[i].size;
+    }
+    return total ? 1.0f - (float)largest/total : 0.0f;
+}
 
-    int X = 0;
-    int Y = 0;
-
-    char *ptr = str;
-    while (*ptr) {
-        if (*ptr == '\n') {
-            if (X > *width)
-                *width = X;
-            X = 0;
-            Y++;
-        } else {
-            X += font.glyph_widths[*ptr-32];
-        }
-        ptr++;
+void font_arena_free(int handle)
+{
+    Font_Arena *a = &font.arena;
+    if (handle < 0 || handle >= a->num_ranges || a->ranges[handle].offset < 0) {
+        printf("font_arena_free: %d is not a live handle\n", handle);
+        return;
     }
+    Font_Arena_Range *r = &a->ranges[handle];
 
-    if (X != 0) {
-        Y++;
-        if (*width == 0)
-            *width = X;
-    } 
+    font_arena_release(a, r->offset, r->size);
+    a->used -= r->size;
+    r->offset = -1;
+    a->free_handles[a->num_free_handles++] = handle;
 
-    *height = Y*font.height;
+    // only worth it with a fair amount of free space
+    if (a->capacity - a->used > a->capacity/4 && font_arena_fragmentation() > FONT_ARENA_COMPACT)
+        font_arena_compact();
 }
 
-Font *font_get_font()
+static int font_arena_cmp_offset(const void *x, const void *y)
 {
-    return &font;
+    const Font_Arena_Range *ranges = font.arena.ranges;
+    return ranges[*(const int*)x].offset - ranges[*(const int*)y].offset;
 }
 
 /*
-    Reads easy_font_raw.png and extracts the font info
-    i.e. offset and width of each glyph, by parsing the first row 
-    containing black dots
+    Moves all live ranges to the start of a new buffer, in the order they 
+    were in, leaving one free range at the end. The copies are done on the gpu.
+    A buffer can't copy onto itself where the ranges overlap, hence the new buffer
+*/
+void font_arena_compact()
+{
+    Font_Arena *a = &font.arena;
 
+    int *live = (int*)malloc(sizeof(int)*(a->num_ranges + 1));
+    int num_live = 0;
+    for (int h = 0; h < a->num_ranges; h++) {
+        if (a->ranges[h].offset >= 0)
+            live[num_live++] = h;
+    }
+    qsort(live, num_live, sizeof(int), font_arena_cmp_offset);
+
+    GLuint vbo;
+    glCreateBuffers(1, &vbo);
+    glNamedBufferData(vbo, sizeof(Font_Glyph)*a->capacity, NULL, GL_STATIC_DRAW);
+
+    int offset = 0;
+    for (int i = 0; i < num_live; i++) {
+        Font_Arena_Range *r = &a->ranges[live[i]];
+        if (r->count > 0)
+            glCopyNamedBufferSubData(a->vbo, vbo, sizeof(Font_Glyph)*r->offset, sizeof(Font_Glyph)*offset, sizeof(Font_Glyph)*r->count);
+        r->offset = offset;
+        offset += r->size;
+    }
+    free(live);
 
-    Initialize opengl stuff in the font struct, based on the data read from the file
+    glDeleteBuffers(1, &a->vbo);
+    a->vbo = vbo;
 
-    Creates one grayscale 2D texture containing the font bitmap data (as in the .png file)
-    and one RGBA32F 1D texture containing font metadata, i.e. for some ascii code, where
-    does it have to go to find that glyph in the 2D texture, and how much should it get
+    a->num_free = 0;
+    if (offset < a->capacity)
+        font_arena_release(a, offset, a->capacity - offset);
+    a->compactions++;
+}
 
-    Creates the vbo used for updating and drawing text. 
-    Initially has a max length of MAX_STRING_LEN, but you're not obliged to use all of it
-*/
-void font_init()
+// draws the glyphs uploaded to the range of handle
+void font_arena_draw(int handle, float offset[2], float size[2], float res[2])
 {
-    font.initialized = 1;
-
-    font.program = LoadShaders2( "vertex_shader_text.vs", "fragment_shader_text.fs" );
+    Font_Arena_Range *r = &font.arena.ranges[handle];
+    if (r->count == 0)
+        return;
 
-    int x, y, n;
-    unsigned char *data = stbi_load("vass_font.png", &x, &y, &n, 0);
-    printf("%d %d %d\n", x, y, n);fflush(stdout);
-    //return;
+    glVertexArrayVertexBuffer(font.vao, 1, font.arena.vbo, 0, sizeof(Font_Glyph));
+    font_draw_instances(r->offset, r->count, offset, size, res);
+    glVertexArrayVertexBuffer(font.vao, 1, font.vbo_code_instances, 0, sizeof(Font_Glyph));
+}
 
-    // scan once to count the spacing between the black dots to get the width of each glyph
-    // and the offset to reach that glyph
-    // NOTE: Ugly, but works. Can this be cleaned up?
-    int num = 0;
-    int width = 0;
-    for (int i = 0; i < x; i++) {
-        if (data[n*i+0] == 0 && data[n*i+1] == 0 && data[n*i+2] == 0) {
-            if (i != 0) {
-                font.glyph_widths[num-1] = width;
-                width = 0;
-            } 
-            font.glyph_offsets[num] = i;
+/*
+    Times the cpu layout of str (no upload, no draw) with kerning off and on,
+    using whatever table font_load_kerning loaded. Prints glyphs per microsecond
+    for both, and returns the overhead of kerning, e.g. 0.05 for 5% slower
+*/
+float font_benchmark_kerning(char *str, int iterations)
+{
+    if (font.initialized == 0)
+    {
+        font_init();
+    }
 
-            num++;
+    int len = strlen(str);
+    Font_Glyph *glyphs = (Font_Glyph*)malloc(sizeof(Font_Glyph)*(len + 1));
+    unsigned char *tab_cells = (unsigned char*)malloc(len + 1);
+    int kerning_enabled = font.kerning_enabled;
+    double times[2];
+    int num_glyphs = 0;
+
+    for (int k = 0; k < 2; k++) {
+        font.kerning_enabled = k;
+
+        // warm up
+        Font_Layout_State state;
+        font_layout_begin(&state);
+        font_layout_run(&state, str, NULL, 0, len, glyphs, tab_cells);
+        font_layout_end(&state, glyphs, tab_cells);
+        num_glyphs = state.ctr;
+
+        double t0 = glfwGetTime();
+        for (int i = 0; i < iterations; i++) {
+            font_layout_begin(&state);
+            font_layout_run(&state, str, NULL, 0, len, glyphs, tab_cells);
+            font_layout_end(&state, glyphs, tab_cells);
         }
-        width++;
+        times[k] = (glfwGetTime() - t0)/iterations;
     }
-    font.glyph_widths[num-1] = width;
+    font.kerning_enabled = kerning_enabled;
+    free(glyphs);
+    free(tab_cells);
+
+    float overhead = (float)(times[1]/times[0] - 1.0);
+    printf("layout without kerning %8.1f us, %6.1f glyphs/us\n", times[0]*1e6, num_glyphs/(times[0]*1e6));
+    printf("layout with kerning    %8.1f us, %6.1f glyphs/us, %+.1f%%\n", times[1]*1e6, num_glyphs/(times[1]*1e6), 100.0*overhead);
+    fflush(stdout);
+    return overhead;
+}
 
-    // convert the RGB texture into a 1-byte texture, strip the first line (containing width info)
-    // add padding, so that texture width is a multiple of 4 (for opengl packing compliance)
-    // y-axis is flipped (since input image is in image space, i.e. +Y is downwards)
-    font.height = y-1;
-    font.width = x;
-    font.width_padded = (font.width + 3) & ~0x03;
+/*
+    Retained text objects
 
-    unsigned char *font_bitmap = (unsigned char*)malloc(font.width_padded*font.height);
+    text_create lays out a string once, with the layout options at that time, and
+    keeps the glyphs in the arena. text_draw_all draws every text in one call, and
+    costs nothing on the cpu while no text changes. text_set_transform and 
+    text_set_palette only rewrite the text's params on the gpu, text_set_string 
+    lays out again and reuses the range when the new string fits
+*/
 
-    for (int j = 0; j < font.height; j++) {
-        for (int i = 0; i < font.width; i++) {
-            int k1 = (j+1)*font.width + i;
-            int k2 = (font.height - j - 1)*font.width_padded + i; // flip y-axis of texture
+// makes sure the params ssbo has room for every text id
+static void text_ssbo_reserve(Font_Texts *t)
+{
+    if (t->ssbo_params && t->ssbo_texts >= t->num_texts)
+        return;
 
-            int R = data[n*k1+0];
-            int G = data[n*k1+1];
-            int B = data[n*k1+2];
-            
-            // red = vertical segment, blue = horisontal segment
-            if ((R == 255 || B == 255) && G == 0) {
-                font_bitmap[k2] = 0;
-            } else {
-                font_bitmap[k2] = 255;
-            }
-        }
-    }
+    if (t->ssbo_params)
+        glDeleteBuffers(1, &t->ssbo_params);
+    glCreateBuffers(1, &t->ssbo_params);
+    glNamedBufferData(t->ssbo_params, sizeof(Font_String_Params)*t->max_texts, NULL, GL_DYNAMIC_DRAW);
+    glNamedBufferSubData(t->ssbo_params, 0, sizeof(Font_String_Params)*t->num_texts, t->params);
+    t->ssbo_texts = t->max_texts;
+}
 
-    free(data); 
+// whether text is a live id, prints what's wrong with it otherwise
+static int text_is_live(const char *function, int text)
+{
+    Font_Texts *t = &font.texts;
+    if (text < 0 || text >= t->num_texts || !t->alive[text]) {
+        printf("%s: %d is not a live text\n", function, text);
+        return 0;
+    }
+    return 1;
+}
 
-    //-------------------------------------------------------------------------
-    glGenVertexArrays(1, &font.vao);
-    glBindVertexArray(font.vao);
+int text_create(char *str, char *col, const Font_String_Params *params)
+{
+    if (font.initialized == 0)
+    {
+        font_init();
+    }
 
-    //-------------------------------------------------------------------------
-    // glyph vertex positions, just uv coordinates that will be stretched accordingly 
-    // by the glyphs width and height
-    float v[] = {0.0, 0.0, 
-                 1.0, 0.0, 
-                 0.0, 1.0,
-                 0.0, 1.0,
-                 1.0, 0.0,
-                 1.0, 1.0};
+    Font_Texts *t = &font.texts;
+    int text;
+    if (t->num_free_ids > 0) {
+        text = t->free_ids[--t->num_free_ids];
+    } else {
+        if (t->num_texts == FONT_MAX_BATCH_STRINGS) {
+            printf("text_create: more than %d texts\n", FONT_MAX_BATCH_STRINGS);
+            return -1;
+        }
+        if (t->num_texts == t->max_texts) {
+            t->max_texts = t->max_texts ? 2*t->max_texts : 64;
+            t->params = (Font_String_Params*)realloc(t->params, sizeof(Font_String_Params)*t->max_texts);
+            t->handles = (int*)realloc(t->handles, sizeof(int)*t->max_texts);
+            t->alive = (unsigned char*)realloc(t->alive, t->max_texts);
+            t->free_ids = (int*)realloc(t->free_ids, sizeof(int)*t->max_texts);
+        }
+        text = t->num_texts++;
+    }
 
-    glCreateBuffers(1, &font.vbo_glyph_pos_instance);
-    glNamedBufferStorage(font.vbo_glyph_pos_instance, sizeof(v), v, 0);
-    
-    glEnableVertexArrayAttrib(font.vao, 0);
-    glVertexArrayVertexBuffer(font.vao, 0, font.vbo_glyph_pos_instance, 0, 2*sizeof(float));
-    glVertexArrayAttribFormat(font.vao, 0, 2, GL_FLOAT, GL_FALSE, 0);
-    glVertexArrayBindingDivisor(font.vao, 0, 0);
+    t->handles[text] = -1;
+    t->alive[text] = 1;
+    t->params[text] = *params;
+    text_ssbo_reserve(t);
+    glNamedBufferSubData(t->ssbo_params, sizeof(Font_String_Params)*text, sizeof(Font_String_Params), params);
 
-    //-------------------------------------------------------------------------
-    // instanced vbo for glyph position ascii value and color index
-    // @Incomplete: test_glyph_data is never unmapped
-    
-    // @Bug: Sync issues??
-    // non-DSA works fine without any need for explicit syncing. 
-    // undefine USE_DSA_VBO to see that it works fine without DSA
-//#define USE_DSA_VBO
-#ifdef USE_DSA_VBO
-    glCreateBuffers(1, &font.vbo_code_instances);
-    glNamedBufferStorage(font.vbo_code_instances, 4*4*MAX_STRING_LEN, NULL, GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT | GL_DYNAMIC_STORAGE_BIT);
-    font.text_glyph_data = glMapNamedBufferRange(font.vbo_code_instances, 0, 4*4*MAX_STRING_LEN, GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT);
-    
-    glEnableVertexArrayAttrib(font.vao, 1);
-    glVertexArrayVertexBuffer(font.vao, 1, font.vbo_code_instances, 0, 4*sizeof(float));
-    glVertexArrayAttribFormat(font.vao, 1, 4, GL_FLOAT, GL_FALSE, 0);
-    glVertexArrayBindingDivisor(font.vao, 1, 1);
-#else
-    font.text_glyph_data = malloc(sizeof(float)*4*MAX_STRING_LEN);
-    glGenBuffers(1, &font.vbo_code_instances);
-    glBindBuffer(GL_ARRAY_BUFFER, font.vbo_code_instances);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(float)*4*MAX_STRING_LEN, NULL, GL_DYNAMIC_DRAW);
+    text_set_string(text, str, col);
+    return text;
+}
 
-    glEnableVertexAttribArray(1);
-    glBindBuffer(GL_ARRAY_BUFFER, font.vbo_code_instances);
-    glVertexAttribPointer(1,4,GL_FLOAT,GL_FALSE,0,(void*)0);
-    glVertexAttribDivisor(1, 1);
-#endif
+void text_set_string(int text, char *str, char *col)
+{
+    if (!text_is_live("text_set_string", text))
+        return;
 
-    //-------------------------------------------------------------------------
-    // create 2D texture and upload font bitmap data
-    glCreateTextures(GL_TEXTURE_2D, 1, &font.texture_fontdata);
-    glTextureParameteri(font.texture_fontdata, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTextureParameteri(font.texture_fontdata, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTextureParameteri(font.texture_fontdata, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTextureParameteri(font.texture_fontdata, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    glTextureStorage2D(font.texture_fontdata, 1, GL_R8, font.width_padded, font.height);
-    glTextureSubImage2D(font.texture_fontdata, 0, 0, 0, font.width_padded, font.height, GL_RED, GL_UNSIGNED_BYTE, font_bitmap);
+    Font_Texts *t = &font.texts;
+    int len = strlen(str);
 
-    //-------------------------------------------------------------------------
-    // create 1D texture and upload font metadata
-    // used for lookup in the bitmap texture    
-    float *texture_metadata = (float*)malloc(sizeof(float)*4*NUM_GLYPHS);
-    
-    for (int i = 0; i < NUM_GLYPHS; i++) {
-        // all the glyphs are in a single line, but in principle we can support multiple lines
-        texture_metadata[4*i+0] = font.glyph_offsets[i]/(double)font.width_padded;
-        texture_metadata[4*i+1] = 0.0;
-        texture_metadata[4*i+2] = font.glyph_widths[i]/(double)font.width_padded;
-        texture_metadata[4*i+3] = 1.0;
+    // the texts never go through the stream, so the scratch is sized here, not by font_reserve
+    if (len > t->max_scratch) {
+        t->max_scratch = len;
+        t->scratch = (Font_Glyph*)realloc(t->scratch, sizeof(Font_Glyph)*t->max_scratch);
+        t->tab_cells = (unsigned char*)realloc(t->tab_cells, t->max_scratch);
     }
 
-    glCreateTextures(GL_TEXTURE_1D, 1, &font.texture_metadata);
-    glTextureParameteri(font.texture_metadata, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTextureParameteri(font.texture_metadata, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTextureStorage1D(font.texture_metadata, 1, GL_RGBA32F, font.width_padded);
-    glTextureSubImage1D(font.texture_metadata, 0, 0, font.width_padded, GL_RGBA, GL_FLOAT, texture_metadata);
+    Font_Layout_State state;
+    font_layout_begin(&state);
+    font_layout_run(&state, str, col, 0, len, t->scratch, t->tab_cells);
+    font_layout_end(&state, t->scratch, t->tab_cells);
+    font_glyphs_tag(t->scratch, state.ctr, text);
 
-    free(texture_metadata);
+    int handle = t->handles[text];
+    if (handle >= 0 && font.arena.ranges[handle].size < state.ctr) {
+        font_arena_free(handle);
+        handle = -1;
+    }
+    if (handle < 0) {
+        handle = font_arena_alloc(state.ctr);
+        t->handles[text] = handle;
+    }
+    if (font.arena.ranges[handle].count != state.ctr)
+        t->commands_dirty = 1;
+    font_arena_upload(handle, t->scratch, state.ctr);
 }
 
+// moves and scales a text, only its first 16 bytes of params are uploaded
+void text_set_transform(int text, float offset[2], float size[2])
+{
+    if (!text_is_live("text_set_transform", text))
+        return;
 
-void font_draw(char *str, char *col, float offset[2], float size[2], float res[2]) 
+    Font_String_Params *p = &font.texts.params[text];
+    p->offset[0] = offset[0];
+    p->offset[1] = offset[1];
+    p->size[0] = size[0];
+    p->size[1] = size[1];
+    glNamedBufferSubData(font.texts.ssbo_params, sizeof(Font_String_Params)*text, 4*sizeof(float), p);
+}
+
+void text_set_palette(int text, int palette)
 {
-    if (font.initialized == 0)
-    {
-        font_init();
+    if (palette < 0 || palette >= FONT_MAX_PALETTES) {
+        printf("text_set_palette: palette %d out of range, there are %d\n", palette, FONT_MAX_PALETTES);
+        return;
     }
+    if (!text_is_live("text_set_palette", text))
+        return;
 
-    // Update/Upload
-    if (font.ctr > MAX_STRING_LEN) {
-        printf("Error: string too long. Returning\n");
+    Font_String_Params *p = &font.texts.params[text];
+    p->palette = palette;
+    glNamedBufferSubData(font.texts.ssbo_params, sizeof(Font_String_Params)*text + ((char*)&p->palette - (char*)p), sizeof(int), &p->palette);
+}
+
+void text_set_params(int text, const Font_String_Params *params)
+{
+    if (!text_is_live("text_set_params", text))
         return;
-    } 
 
-    float X = 0.0;
-    float Y = 0.0;
+    font.texts.params[text] = *params;
+    glNamedBufferSubData(font.texts.ssbo_params, sizeof(Font_String_Params)*text, sizeof(Font_String_Params), params);
+}
 
-    int ctr = 0;
-    float height = font.height;
-    // float width_padded = font.width_padded;
+void text_destroy(int text)
+{
+    if (!text_is_live("text_destroy", text))
+        return;
 
-    // int *glyph_offsets = font.glyph_offsets;
-    int *glyph_widths = font.glyph_widths;
+    Font_Texts *t = &font.texts;
+    if (t->handles[text] >= 0)
+        font_arena_free(t->handles[text]);
+    t->handles[text] = -1;
+    t->alive[text] = 0;
+    t->free_ids[t->num_free_ids++] = text;
+    t->commands_dirty = 1;
+}
 
-    int len = strlen(str);
-    for (int i = 0; i < len; i++) {
+// draws all texts with one glMultiDrawArraysIndirect, a command per text
+void text_draw_all()
+{
+    Font_Texts *t = &font.texts;
+    if (t->num_texts == 0)
+        return;
 
-        if (str[i] == '\n') {
-            X = 0.0;
-            Y -= height;
-            continue;
+    if (t->commands_dirty || t->compactions != font.arena.compactions) {
+        GLuint *commands = (GLuint*)malloc(4*sizeof(GLuint)*t->num_texts);
+        t->num_commands = 0;
+        for (int i = 0; i < t->num_texts; i++) {
+            if (t->handles[i] < 0)
+                continue;
+            Font_Arena_Range *r = &font.arena.ranges[t->handles[i]];
+            if (r->count == 0)
+                continue;
+            GLuint *c = commands + 4*t->num_commands++;
+            c[0] = 6;           // vertices per glyph
+            c[1] = r->count;    // instances
+            c[2] = 0;
+            c[3] = r->offset;   // base instance
         }
+        if (!t->buffer_commands)
+            glCreateBuffers(1, &t->buffer_commands);
+        glNamedBufferData(t->buffer_commands, 4*sizeof(GLuint)*t->num_commands, commands, GL_DYNAMIC_DRAW);
+        free(commands);
 
+        t->commands_dirty = 0;
+        t->compactions = font.arena.compactions;
+    }
+    if (t->num_commands == 0)
+        return;
 
-        int code_base = str[i]-32; // first glyph is ' ', i.e. ascii code 32
-        // float offset = glyph_offsets[code_base];
-        float width = glyph_widths[code_base];
+    font_tagged_begin(font.arena.vbo, t->ssbo_params);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, t->buffer_commands);
+    glMultiDrawArraysIndirect(GL_TRIANGLES, 0, t->num_commands, 0);
+    font.stats.draw_calls++;
+    font_tagged_end();
+}
 
-        float x1 = X;
-        float y1 = Y;
+/*
+    Time sliced layout, for strings too large to lay out within a single frame
 
-        int ctr1 = 4*ctr;
-        font.text_glyph_data[ctr1++] = x1;
-        font.text_glyph_data[ctr1++] = y1;
-        font.text_glyph_data[ctr1++] = code_base;
-        font.text_glyph_data[ctr1++] = col ? col[i] : 0;
+    font_job_begin sets up a job with its own glyph storage and vbo. Each frame
+    font_job_step lays out whole lines until the time budget is used up 
+    (at least one line per step), uploads only the new glyphs, and remembers 
+    where it stopped. font_job_draw draws everything laid out so far.
 
-        X += width;
-        ctr++;
+    The layout options (alignment, tabs etc.) are taken from the font at font_job_begin.
+    With elastic tabs the columns are only known at the end, so cells are placed
+    relative to their own column until the job is done
+*/
+void font_job_begin(Font_Layout_Job *job, char *str, char *col)
+{
+    if (font.initialized == 0)
+    {
+        font_init();
     }
 
-    #ifndef USE_DSA_VBO
-    // actual uploading
-    glBindBuffer(GL_ARRAY_BUFFER, font.vbo_code_instances);
-    glBufferSubData(GL_ARRAY_BUFFER, 0, 4*4*ctr, font.text_glyph_data);
-    #endif
-    font.ctr = ctr;
+    memset(job, 0, sizeof(*job));
+    job->str = str;
+    job->col = col;
+    job->len = strlen(str);
+    font_layout_begin(&job->state);
+
+    // can't produce more glyphs than chars
+    int capacity = job->len > 0 ? job->len : 1;
+    job->glyph_data = (Font_Glyph*)malloc(sizeof(Font_Glyph)*capacity);
+    if (job->state.elastic)
+        job->tab_cells = (unsigned char*)malloc(capacity);
+    if (font.hit_index_enabled) {
+        font_index_reset(&job->index, capacity);
+        job->state.index = &job->index;
+    }
+
+    glCreateBuffers(1, &job->vbo);
+    glNamedBufferData(job->vbo, sizeof(Font_Glyph)*capacity, NULL, GL_STATIC_DRAW);
+}
 
-    // Drawing
-    glUseProgram(font.program);
-    glUniform1f(glGetUniformLocation(font.program, "time"), glfwGetTime());
-    glUniform3fv(glGetUniformLocation(font.program, "colors"), 9, colors);
-    glUniform2fv(glGetUniformLocation(font.program, "string_offset"), 1, offset);
-    glUniform2fv(glGetUniformLocation(font.program, "string_size"), 1, size);
-    glUniform2fv(glGetUniformLocation(font.program, "resolution"), 1, res);
+// returns 1 when the whole string has been laid out
+int font_job_step(Font_Layout_Job *job, double budget_us)
+{
+    if (job->done)
+        return 1;
+
+    double t0 = glfwGetTime();
+    do {
+        const char *eol = (const char*)memchr(job->str + job->cursor, '\n', job->len - job->cursor);
+        int end = eol ? (int)(eol - job->str) + 1 : job->len;
+
+        font_layout_run(&job->state, job->str, job->col, job->cursor, end, job->glyph_data, job->tab_cells);
+        job->cursor = end;
+    } while (job->cursor < job->len && (glfwGetTime() - t0)*1e6 < budget_us);
+
+    // finished lines don't move anymore, except for elastic cells and the last line
+    int first = job->uploaded;
+    if (job->cursor >= job->len) {
+        font_layout_end(&job->state, job->glyph_data, job->tab_cells);
+        if (job->state.elastic)
+            first = 0;
+        else if (job->state.line_start < first)
+            first = job->state.line_start;
+        job->done = 1;
+    }
 
+    int count = job->state.ctr - first;
+    if (count > 0)
+        glNamedBufferSubData(job->vbo, sizeof(Font_Glyph)*first, sizeof(Font_Glyph)*count, job->glyph_data + first);
+    job->uploaded = job->state.ctr;
 
-    glBindTextureUnit(0, font.texture_fontdata);
-    glBindTextureUnit(1, font.texture_metadata);
+    return job->done;
+}
 
-    glBindVertexArray(font.vao);
+void font_job_draw(Font_Layout_Job *job, float offset[2], float size[2], float res[2])
+{
+    if (job->uploaded == 0)
+        return;
 
-    glDrawArraysInstanced(GL_TRIANGLES, 0, 6, font.ctr);
-    //glFinish();
+    glVertexArrayVertexBuffer(font.vao, 1, job->vbo, 0, sizeof(Font_Glyph));
+    font_draw_instances(0, job->uploaded, offset, size, res);
+    glVertexArrayVertexBuffer(font.vao, 1, font.vbo_code_instances, 0, sizeof(Font_Glyph));
+}
+
+// like font_hit_test, for the part of the job laid out so far
+int font_job_hit_test(Font_Layout_Job *job, double x, double y, float offset[2], float size[2], float res[2])
+{
+    return font_index_query(&job->index, job->glyph_data, job->state.ctr, x, y, offset, size, res);
+}
+
+// like font_highlights_add, for the part of the job laid out so far
+void font_job_highlights_add(Font_Layout_Job *job, Font_Highlights *h, int begin, int end, int color)
+{
+    font_index_highlight(h, &job->index, job->glyph_data, job->state.ctr, begin, end, color);
+}
+
+void font_job_end(Font_Layout_Job *job)
+{
+    glDeleteBuffers(1, &job->vbo);
+    free(job->glyph_data);
+    free(job->tab_cells);
+    font_index_free(&job->index);
+    memset(job, 0, sizeof(*job));
 }
 
 char *readFile2(const char *filename) {
@@ -383,7 +3718,25 @@ char *readFile2(const char *filename) {
     return string;
 }
 
+// the #version line has to come first, so the defines are inserted right after it
+static void ShaderSourceDefines2(GLuint ShaderID, const char *Code, const char *defines)
+{
+    const char *eol = strchr(Code, '\n');
+    if (!defines || !eol) {
+        glShaderSource(ShaderID, 1, &Code, NULL);
+        return;
+    }
+
+    const char *sources[3] = {Code, defines, eol+1};
+    GLint lengths[3] = {(GLint)(eol+1 - Code), -1, -1};
+    glShaderSource(ShaderID, 3, sources, lengths);
+}
+
 GLuint LoadShaders2(const char * vertex_file_path,const char * fragment_file_path){
+    return LoadShadersDefines2(vertex_file_path, fragment_file_path, NULL);
+}
+
+GLuint LoadShadersDefines2(const char * vertex_file_path,const char * fragment_file_path, const char *defines){
     GLint Result = GL_FALSE;
     int InfoLogLength;
 
@@ -394,7 +3747,7 @@ GLuint LoadShaders2(const char * vertex_file_path,const char * fragment_file_pat
 
     // Compile Vertex Shader
     printf("Compiling shader : %s\n", vertex_file_path); fflush(stdout);
-    glShaderSource(VertexShaderID, 1, (const char**)&VertexShaderCode , NULL);
+    ShaderSourceDefines2(VertexShaderID, VertexShaderCode, defines);
     glCompileShader(VertexShaderID);
 
     // Check Vertex Shader
@@ -415,7 +3768,7 @@ GLuint LoadShaders2(const char * vertex_file_path,const char * fragment_file_pat
 
     // Compile Fragment Shader
     printf("Compiling shader : %s\n", fragment_file_path); fflush(stdout);
-    glShaderSource(FragmentShaderID, 1, (const char**)&FragmentShaderCode , NULL);
+    ShaderSourceDefines2(FragmentShaderID, FragmentShaderCode, defines);
     glCompileShader(FragmentShaderID);
 
     // Check Fragment Shader
@@ -455,6 +3808,45 @@ GLuint LoadShaders2(const char * vertex_file_path,const char * fragment_file_pat
 }
 
 
+GLuint LoadComputeShaderDefines2(const char * compute_file_path, const char *defines){
+    GLint Result = GL_FALSE;
+    int InfoLogLength;
+
+    GLuint ComputeShaderID = glCreateShader(GL_COMPUTE_SHADER);
+    char *ComputeShaderCode = readFile2(compute_file_path);
+
+    printf("Compiling shader : %s\n", compute_file_path); fflush(stdout);
+    ShaderSourceDefines2(ComputeShaderID, ComputeShaderCode, defines);
+    glCompileShader(ComputeShaderID);
+
+    glGetShaderiv(ComputeShaderID, GL_COMPILE_STATUS, &Result);
+    glGetShaderiv(ComputeShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
+    if ( InfoLogLength > 0 ){
+        char ComputeShaderErrorMessage[9999];
+        glGetShaderInfoLog(ComputeShaderID, InfoLogLength, NULL, ComputeShaderErrorMessage);
+        printf("%s\n", ComputeShaderErrorMessage); fflush(stdout);
+    }
+
+    printf("Linking program\n"); fflush(stdout);
+    GLuint ProgramID = glCreateProgram();
+    glAttachShader(ProgramID, ComputeShaderID);
+    glLinkProgram(ProgramID);
+
+    glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
+    glGetProgramiv(ProgramID, GL_INFO_LOG_LENGTH, &InfoLogLength);
+    if ( InfoLogLength > 0 ){
+        GLchar ProgramErrorMessage[9999];
+        glGetProgramInfoLog(ProgramID, InfoLogLength, NULL, &ProgramErrorMessage[0]);
+        printf("%s\n", &ProgramErrorMessage[0]); fflush(stdout);
+    }
+
+    glDeleteShader(ComputeShaderID);
+    free(ComputeShaderCode);
+
+    return ProgramID;
+}
+
+
 #endif
 
 
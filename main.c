@@ -27,6 +27,12 @@ double resy = 1000;
 
 double prevx, prevy;    // for mouse position
 int clickedButtons = 0; // bit field for mouse clicks
+int clickPending = 0;   // set on left click, mapped to a char in the source text next frame
+int drawLargeDocument = 0; // toggled with 'L', for timing layout and upload of many glyphs
+int gpuLayout = 0;         // toggled with 'G', lays out the large document with a compute shader
+int vertexPulling = 0;     // toggled with 'P', draws the large document without instance data
+int benchmarkPending = 0;  // set with 'B', times the glyph streams and kerning in the main loop
+int jobLayout = 0;         // toggled with 'J', lays out the large document a slice per frame
 
 enum buttonMaps { FIRST_BUTTON=1, SECOND_BUTTON=2, THIRD_BUTTON=4, FOURTH_BUTTON=8, FIFTH_BUTTON=16, NO_BUTTON=0 };
 enum modifierMaps { CTRL=2, SHIFT=1, ALT=4, META=8, NO_MODIFIER=0 };
@@ -255,19 +261,283 @@ void color_string(char *str, char *col)
     }
 }
 
+/*
+    Checks that font_string_dimensions agrees with what font_layout actually
+    lays out, for strings with control chars the layout skips ('\r', ESC with
+    and without markup, tabs, other low bytes). Prints any mismatch, returns their number
+*/
+int check_measurement()
+{
+    char *strings[] = {
+        "abc\r\ndef", "ab" FONT_ESC "3cd", "AV\001To\177x", "x" FONT_ESC, FONT_ESC "\n" FONT_ESC "3",
+        "line1\nVery long line\r\n\002\003\004", "", "tab\tbed" FONT_ESC "5AV", "\n\n", "end\n",
+        "a\tb\nc" FONT_ESC "2", "\t" FONT_ESC "1x\n" FONT_ESC "4", "p" FONT_ESC "BAV" FONT_ESC "3x" FONT_ESC "r",
+    };
+    int num_strings = sizeof(strings)/sizeof(strings[0]);
+    Font *f = font_get_font();
+    int kerning_enabled = f->kerning_enabled;
+
+    int failed = 0;
+    for (int markup = 0; markup < 2; markup++) {
+        for (int kerning = 0; kerning < 2; kerning++) {
+            font_set_markup(markup);
+            font_set_kerning(kerning);
+            for (int i = 0; i < num_strings; i++) {
+                int width, height;
+                Font_Bounds bounds;
+                font_string_dimensions(strings[i], &width, &height);
+                font_layout(strings[i], NULL, &bounds);
+                if (width != bounds.width || height != bounds.height) {
+                    printf("measurement of string %d (markup %d, kerning %d) is %dx%d, layout is %dx%d\n", 
+                           i, markup, kerning, width, height, bounds.width, bounds.height);
+                    failed++;
+                }
+            }
+        }
+    }
+    font_set_markup(0);
+    font_set_kerning(kerning_enabled);
+    return failed;
+}
+
+/*
+    A line with more elastic tab cells than FONT_MAX_TAB_COLUMNS: the cells past
+    the last column must still move right instead of landing on top of each
+    other, and be measured the same way. Returns the number of failures
+*/
+int check_tab_columns()
+{
+    int num_cells = FONT_MAX_TAB_COLUMNS + 16;
+    char *str = (char*)malloc(3*num_cells + 5);
+    for (int i = 0; i < num_cells; i++) {
+        memcpy(str + 3*i, "ab\t", 3);
+    }
+    strcpy(str + 3*num_cells, "\nx\ty");
+    int len = strlen(str);
+
+    Font_Glyph *glyphs = (Font_Glyph*)malloc(len*sizeof(Font_Glyph));
+    unsigned char *tab_cells = (unsigned char*)malloc(len);
+    font_set_tabs(0, NULL, 0, 1);
+
+    Font_Layout_State state;
+    font_layout_begin(&state);
+    font_layout_run(&state, str, NULL, 0, len, glyphs, tab_cells);
+    font_layout_end(&state, glyphs, tab_cells);
+
+    int failed = 0;
+    for (int i = 1; i < 2*num_cells; i++) {
+        if (glyphs[i].x <= glyphs[i-1].x) {
+            printf("elastic glyph %d at x = %g, not right of %g\n", i, (float)glyphs[i].x, (float)glyphs[i-1].x);
+            failed++;
+            break;
+        }
+    }
+
+    int width, height;
+    Font_Bounds bounds;
+    font_string_dimensions(str, &width, &height);
+    font_layout_bounds(&state, &bounds);
+    if (width != bounds.width) {
+        printf("measured %d cells as %d px wide, layout is %d px\n", num_cells, width, bounds.width);
+        failed++;
+    }
+
+    font_set_tabs(0, NULL, 0, 0);
+    free(tab_cells);
+    free(glyphs);
+    free(str);
+    return failed;
+}
+
+#ifdef FONT_PACKED_INSTANCES
+/*
+    Lays out more lines than 16 bit pixel positions could hold, checking every
+    glyph landed on its row, and a line wider than FONT_PACKED_MAX, which has
+    to be refused rather than wrap around. Returns the number of failures
+*/
+int check_packed_layout()
+{
+    int num_lines = 5000;
+    int len = FONT_PACKED_MAX + 1 > 3*num_lines ? FONT_PACKED_MAX + 1 : 3*num_lines;
+    char *str = (char*)malloc(len + 1);
+    Font_Glyph *glyphs = (Font_Glyph*)malloc(len*sizeof(Font_Glyph));
+    Font *f = font_get_font();
+
+    for (int i = 0; i < num_lines; i++) {
+        memcpy(str + 3*i, "ab\n", 3);
+    }
+    Font_Layout_State state;
+    font_layout_begin(&state);
+    font_layout_run(&state, str, NULL, 0, 3*num_lines, glyphs, NULL);
+    font_layout_end(&state, glyphs, NULL);
+
+    int failed = state.ctr != 2*num_lines || state.lines != num_lines;
+    for (int i = 0; i < state.ctr && !failed; i++) {
+        int x = i % 2 ? f->glyph_widths['a' - 32] : 0;
+        if (glyphs[i].x != x || glyphs[i].y != -i/2) {
+            printf("packed glyph %d is at (%d, %d), expected (%d, %d)\n", i, glyphs[i].x, glyphs[i].y, x, -i/2);
+            failed++;
+        }
+    }
+
+    // prints the refusal
+    memset(str, 'x', len);
+    font_layout_begin(&state);
+    font_layout_run(&state, str, NULL, 0, len, glyphs, NULL);
+    font_layout_end(&state, glyphs, NULL);
+    if (state.ctr != 0) {
+        printf("packed layout %d px wide wasn't refused\n", len*f->glyph_widths['x' - 32]);
+        failed++;
+    }
+
+    free(glyphs);
+    free(str);
+    return failed;
+}
+#endif
+
+/*
+    Lays out a string long enough for pass 1 of compute_shader_layout.cs to go
+    over more than one block of chunks, on the gpu and on the cpu, and compares
+    the glyphs. Runs on llvmpipe too (LIBGL_ALWAYS_SOFTWARE=1). Returns the number of failures
+*/
+int check_gpu_layout()
+{
+    int len = 300*FONT_LAYOUT_CHUNK + 77;
+    char *str = (char*)malloc(len + 1);
+    char *col = (char*)malloc(len);
+    for (int i = 0; i < len; i++) {
+        int r = (i*7919) % 61;
+        str[i] = r == 0 ? '\n' : r == 1 ? '\r' : r == 2 ? '\001' : 32 + (i*31) % 95;
+        col[i] = i % 9;
+    }
+    str[len] = 0;
+    Font *f = font_get_font();
+    int gpu_layout_enabled = f->gpu_layout_enabled;
+    int hit_index_enabled = f->hit_index_enabled;
+
+    font_set_hit_index(0);
+    font_set_gpu_layout(1);
+    font_layout(str, col, NULL);
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    GLuint command[4];
+    glGetNamedBufferSubData(f->buffer_command, 0, sizeof(command), command);
+    Font_Glyph *gpu = (Font_Glyph*)malloc(len*sizeof(Font_Glyph));
+    glGetNamedBufferSubData(f->vbo_code_instances, command[3]*sizeof(Font_Glyph), command[1]*sizeof(Font_Glyph), gpu);
+
+    Font_Glyph *cpu = (Font_Glyph*)malloc(len*sizeof(Font_Glyph));
+    Font_Layout_State state;
+    font_layout_begin(&state);
+    font_layout_run(&state, str, col, 0, len, cpu, NULL);
+    font_layout_end(&state, cpu, NULL);
+
+    int failed = 0;
+    if ((int)command[1] != state.ctr) {
+        printf("gpu layout has %u glyphs, cpu layout %d\n", command[1], state.ctr);
+        failed++;
+    }
+    for (int i = 0; i < state.ctr && i < (int)command[1] && !failed; i++) {
+        if (gpu[i].x != cpu[i].x || gpu[i].y != cpu[i].y || gpu[i].glyph != cpu[i].glyph || gpu[i].color != cpu[i].color) {
+            printf("gpu glyph %d is at (%g, %g), cpu glyph at (%g, %g)\n", 
+                   i, (float)gpu[i].x, (float)gpu[i].y, (float)cpu[i].x, (float)cpu[i].y);
+            failed++;
+        }
+    }
+
+    font_set_gpu_layout(gpu_layout_enabled);
+    font_set_hit_index(hit_index_enabled);
+    free(cpu);
+    free(gpu);
+    free(col);
+    free(str);
+    return failed;
+}
+
 int main() 
 {
     init_GL();
 
+    // a real table for 'K' and the kerning benchmark, off until toggled
+    font_load_kerning("kerning.txt");
+    font_set_kerning(0);
+    if (check_measurement() == 0) {
+        printf("measurement matches layout\n"); fflush(stdout);
+    }
+    if (check_tab_columns() == 0) {
+        printf("tab cells past the last elastic column are laid out and measured\n"); fflush(stdout);
+    }
+#ifdef FONT_PACKED_INSTANCES
+    if (check_packed_layout() == 0) {
+        printf("packed layout past 16 bit pixel positions is in range\n"); fflush(stdout);
+    }
+#endif
+    if (check_gpu_layout() == 0) {
+        printf("gpu layout matches the cpu layout\n"); fflush(stdout);
+    }
+
     char *fragment_source = readFile2("vertex_shader_text.vs");
     char *col = (char*)calloc(strlen(fragment_source), 1);
     color_string(fragment_source, col); // syntax highlighting
 
+    // the source repeated to nearly MAX_STRING_LEN chars
+    int source_len = strlen(fragment_source);
+    int copies = (MAX_STRING_LEN - 1)/source_len;
+    char *large_source = (char*)malloc(copies*source_len + 1);
+    char *large_col = (char*)malloc(copies*source_len);
+    for (int i = 0; i < copies; i++) {
+        memcpy(large_source + i*source_len, fragment_source, source_len);
+        memcpy(large_col + i*source_len, col, source_len);
+    }
+    large_source[copies*source_len] = '\0';
+
     double t1 = glfwGetTime();
 
     double dt_avg = 0.0;  // first moment
     double dt_avg2 = 0.0; // second moment
 
+    Font_Highlights matches = {0}; // search matches in the source text
+
+    // font_draw only collects strings, font_flush draws them
+    font_set_batching(1);
+
+    // the labels never change, so they're laid out once and only placed again on resize
+    char str1[] = "1. I'm left aligned";
+    char str2[] = "2. I'm Right aligned!";
+    char str3[] = "3. Am I " FONT_ESC "3centered" FONT_ESC "r!?";
+    Font_String_Params label_params;
+    float zero[2] = {0.0, 0.0};
+    font_params_init(&label_params, zero, zero, zero);
+
+    font_set_align(FONT_ALIGN_RIGHT, 0);
+    int label1 = text_create(str1, NULL, &label_params);
+    font_set_align(FONT_ALIGN_LEFT, 0);
+    int label2 = text_create(str2, NULL, &label_params);
+    font_set_align(FONT_ALIGN_CENTER, 0);
+    font_set_markup(1);
+    int label3 = text_create(str3, NULL, &label_params);
+    font_set_markup(0);
+    font_set_align(FONT_ALIGN_LEFT, 0);
+    double labels_resx = 0.0;
+    double labels_resy = 0.0;
+
+    Font_Stats frame_stats = {0}; // gl calls of the last frame
+
+    // the large document laid out with a job, while 'J' and 'L' are on
+    Font_Layout_Job large_job;
+    int large_job_active = 0;
+
+    // timing of the large document: cpu time of font_layout (layout and upload), and
+    // gpu time from the layout to the end of its draw. two queries, so the one read
+    // back is always from the frame before and never stalls
+    GLuint timer_queries[2];
+    int timer_pending[2] = {0, 0};
+    glGenQueries(2, timer_queries);
+    double large_cpu = 0.0;
+    double large_gpu = 0.0;
+    int large_cpu_samples = 0;
+    int large_gpu_samples = 0;
+    int timer_frame = 0;
+
     int frames_to_avg = 100;
     int frame_ctr = 0;
     glfwSwapInterval(0);
@@ -285,10 +555,21 @@ int main()
             dt_avg2 /= frames_to_avg;
             double dt_ste = sqrt(dt_avg2 - dt_avg*dt_avg)/sqrt(frames_to_avg);
 
-            char str[64];
-            sprintf(str, "time frame = %.3fms +/- %.4fms, fps = %.1f, %d frames", 
-                         1000.0*dt_avg, 1000.0*dt_ste, 1.0/dt_avg, frames_to_avg);
+            char str[320];
+            int n = sprintf(str, "time frame = %.3fms +/- %.4fms, fps = %.1f, %d frames, %d draws, %d binds, %d uniforms, %d skipped", 
+                         1000.0*dt_avg, 1000.0*dt_ste, 1.0/dt_avg, frames_to_avg, frame_stats.draw_calls,
+                         frame_stats.program_binds + frame_stats.texture_binds + frame_stats.vao_binds,
+                         frame_stats.uniform_uploads, frame_stats.skipped);
+            if (large_cpu_samples > 0) {
+                sprintf(str + n, ", large document: layout+upload %.3fms cpu, layout+draw %.3fms gpu",
+                        1000.0*large_cpu/large_cpu_samples, large_gpu_samples ? 1000.0*large_gpu/large_gpu_samples : 0.0);
+                printf("%s\n", str + n + 2); fflush(stdout);
+            }
             glfwSetWindowTitle(window, str);
+            large_cpu = 0.0;
+            large_gpu = 0.0;
+            large_cpu_samples = 0;
+            large_gpu_samples = 0;
 
             frames_to_avg = (int)(1.0/dt_avg); // this should make it update approximitely once per second
 
@@ -303,30 +584,105 @@ int main()
         float scale[2] = {2.0, 2.0};
         float res[2] = {(float)resx, (float)resy};
         float offset[2] = {(float)(-1.0 + scale[0]*2.0*1.0/res[0]), (float)(1.0 - scale[1]*2.0*12.0/res[1])};
-        font_draw(fragment_source, col, offset, scale, res);  // Only font drawing stuff in here
-
-        char str1[] = "1. I'm left aligned";
-        char str2[] = "2. I'm Right aligned!";
-        char str3[] = "3. Am I centered!?";
-        int width1, width2, width3;
-        int height1, height2, height3;
-        font_string_dimensions(str1, &width1, &height1);
-        font_string_dimensions(str2, &width2, &height2);
-        font_string_dimensions(str3, &width3, &height3);
-
-        float offset1[2] = {(float)(0.0 - scale[0]*2.0*width1/res[0]), (float)(0.0        - scale[1]*2.0*height1/res[1])};
-        float offset2[2] = {(float)(0.0 + 0.0*scale[0]*2.0*width2/res[0]), (float)(offset1[1] - scale[1]*2.0*height2/res[1])};
-        float offset3[2] = {(float)(0.0 - scale[0]*2.0*width3/2.0/res[0]), (float)(offset2[1] - scale[1]*2.0*height3/res[1])};
-
-        font_draw(str1, NULL, offset1, scale, res);
-        font_draw(str2, NULL, offset2, scale, res);
-        font_draw(str3, NULL, offset3, scale, res);
+        // Only font drawing stuff in here
+        if (benchmarkPending) {
+            font_benchmark_streams(fragment_source, 200);
+            font_benchmark_kerning(large_source, 200);
+            benchmarkPending = 0;
+        }
+        // the gpu layouts can't be hit tested, so they're only used without the index
+        font_set_hit_index(!(drawLargeDocument && (gpuLayout || vertexPulling)));
+        int timer = timer_frame++ & 1;
+        if (timer_pending[timer]) {
+            GLuint64 ns;
+            glGetQueryObjectui64v(timer_queries[timer], GL_QUERY_RESULT, &ns);
+            large_gpu += ns*1e-9;
+            large_gpu_samples++;
+            timer_pending[timer] = 0;
+        }
+        int use_job = drawLargeDocument && jobLayout;
+        if (use_job) {
+            // at most 2 ms of layout per frame, what's done so far is drawn right away
+            if (!large_job_active) {
+                font_job_begin(&large_job, large_source, large_col);
+                large_job_active = 1;
+            }
+            if (!large_job.done && font_job_step(&large_job, 2000.0)) {
+                printf("job finished laying out the large document\n"); fflush(stdout);
+            }
+        } else {
+            if (large_job_active) {
+                font_job_end(&large_job);
+                large_job_active = 0;
+            }
+            if (drawLargeDocument) {
+                glBeginQuery(GL_TIME_ELAPSED, timer_queries[timer]);
+                double t_layout = glfwGetTime();
+                font_layout(large_source, large_col, NULL);
+                large_cpu += glfwGetTime() - t_layout;
+                large_cpu_samples++;
+            } else {
+                font_layout(fragment_source, col, NULL);
+            }
+        }
+
+        // the text doesn't change, so the matches are only found and uploaded once
+        if (matches.count == 0) {
+            for (char *p = strstr(fragment_source, "uniform"); p; p = strstr(p+1, "uniform")) {
+                int i = p - fragment_source;
+                font_highlights_add(&matches, i, i + strlen("uniform"), 7);
+            }
+        }
+        font_highlights_draw(&matches, offset, scale, res);
+        if (use_job) {
+            font_job_draw(&large_job, offset, scale, res);
+        } else {
+            font_draw_layout(offset, scale, res);
+        }
+        if (drawLargeDocument && !use_job) {
+            glEndQuery(GL_TIME_ELAPSED);
+            timer_pending[timer] = 1;
+        }
+        if (clickPending) {
+            int i = use_job ? font_job_hit_test(&large_job, prevx, prevy, offset, scale, res)
+                            : font_hit_test(prevx, prevy, offset, scale, res);
+            printf("clicked at char %d\n", i); fflush(stdout);
+            clickPending = 0;
+        }
+        font_set_hit_index(0);
+
+        // each label is a single line, aligned around the center of the screen
+        if (labels_resx != resx || labels_resy != resy) {
+            float line_height = scale[1]*2.0*font_get_font()->height/res[1];
+            int labels[3] = {label1, label2, label3};
+            for (int i = 0; i < 3; i++) {
+                float label_offset[2] = {0.0, -(i + 1)*line_height};
+                font_params_init(&label_params, label_offset, scale, res);
+                text_set_params(labels[i], &label_params);
+            }
+            labels_resx = resx;
+            labels_resy = resy;
+        }
+        text_draw_all();
+
+        // all the font_draw calls of the frame in one draw call
+        font_flush();
+        font_get_stats(&frame_stats);
+        font_reset_stats();
+        if (frame_stats.storage_grows) {
+            printf("glyph storage grew to %d glyphs\n", font_get_font()->capacity); fflush(stdout);
+        }
         
         glfwSwapBuffers(window);
     }
 
+    if (large_job_active)
+        font_job_end(&large_job);
+    font_highlights_free(&matches);
     free(fragment_source);
     free(col);
+    free(large_source);
+    free(large_col);
 
     glfwTerminate();
 
@@ -395,6 +751,35 @@ void key_callback(GLFWwindow* win, int key, int scancode, int action, int mods)
         glfwSetWindowShouldClose(win, GL_TRUE);
     }
 
+    if (key == GLFW_KEY_L && action == GLFW_PRESS) {
+        drawLargeDocument = !drawLargeDocument;
+    }
+
+    // lay out the large document over several frames with font_job_step, instead of all at once
+    if (key == GLFW_KEY_J && action == GLFW_PRESS) {
+        jobLayout = !jobLayout;
+    }
+
+    if (key == GLFW_KEY_G && action == GLFW_PRESS) {
+        gpuLayout = !gpuLayout;
+        font_set_gpu_layout(gpuLayout);
+    }
+
+    // time the ways of streaming glyphs to the gpu and keep the fastest, then the cost of kerning
+    if (key == GLFW_KEY_B && action == GLFW_PRESS) {
+        benchmarkPending = 1;
+    }
+
+    if (key == GLFW_KEY_P && action == GLFW_PRESS) {
+        vertexPulling = !vertexPulling;
+        font_set_vertex_pulling(vertexPulling);
+    }
+
+    // toggle kerning, compare the frame timings in the window title
+    if (key == GLFW_KEY_K && action == GLFW_PRESS) {
+        Font *f = font_get_font();
+        font_set_kerning(!f->kerning_enabled);
+    }
 }
 
 // Callback function called every time a mouse button pressed or released
@@ -415,7 +800,7 @@ void mousebutton_callback(GLFWwindow* win, int button, int action, int mods) {
 
     // Test each button
     if (clickedButtons&FIRST_BUTTON) {
-        
+        clickPending = 1;
     } else if (clickedButtons&SECOND_BUTTON) {
 
     } else if (clickedButtons&THIRD_BUTTON) {
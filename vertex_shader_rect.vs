@@ -0,0 +1,20 @@
+#version 450 core
+
+layout(location = 0) in vec2 vertexPosition;
+layout(location = 2) in vec4 instanceRect;
+
+uniform vec2 string_offset;
+uniform vec2 string_size;
+uniform vec2 resolution;
+uniform float line_height;
+
+out float color_index;
+
+void main(){
+    // instanceRect is (x, y, width, color index) in the same string space (pixels) as the glyphs
+    vec2 p = string_offset + 2.0*string_size*(vertexPosition*vec2(instanceRect.z, line_height) + instanceRect.xy)/vec2(resolution.x, resolution.y);
+
+    color_index = instanceRect.w;
+
+    gl_Position = vec4(p, 0.0, 1.0);
+}
@@ -1,20 +1,103 @@
 #version 450 core
 
 layout(location = 0) in vec2 vertexPosition;
+#ifdef FONT_PULL
+// no instance data, each instance fetches its char from the raw string and finds
+// its line in a table of line starts. see font_set_vertex_pulling
+layout(std430, binding = 0) readonly buffer Text   { uint text[];   }; // 4 chars per uint
+layout(std430, binding = 1) readonly buffer Colors { uint colors[]; }; // 4 color indices per uint
+layout(std430, binding = 4) readonly buffer Lines  { int line_starts[]; };
+#ifndef FONT_MONOSPACE
+layout(std430, binding = 6) readonly buffer PullX  { float pull_x[]; };   // x of each char in its line
+#endif
+
+uniform int num_lines;
+uniform int has_colors;
+uniform float height;
+
+uint byte_at(int i, bool color)
+{
+    uint word = color ? colors[i >> 2] : text[i >> 2];
+    return (word >> ((i & 3)*8)) & 0xFFu;
+}
+#elif defined(FONT_PACKED_INSTANCES)
+layout(location = 1) in ivec4 instancePacked; // (x, y, glyph | color << 8, flags), flags is the string in a batch
+#elif defined(FONT_BATCH)
+layout(location = 1) in vec4 instanceTagged;  // (x, y, glyph, color + 256*string)
+#else
 layout(location = 1) in vec4 instanceGlyph;
+#endif
 
+#ifdef FONT_BATCH
+// every glyph knows which string it's from, so all strings share a draw. see Font_String_Params
+struct Font_String {
+    vec4 offset_size;   // (string_offset, string_size)
+    vec4 clip;          // (x0, y0, x1, y1) in NDC
+    vec2 resolution;
+    int palette;
+    float z;
+};
+layout(std430, binding = 5) readonly buffer Strings { Font_String strings[]; };
+#else
 uniform vec2 string_offset;
 uniform vec2 string_size;
+uniform vec2 resolution;
+#endif
 
 layout(binding = 0) uniform sampler2D sampler_font;
 layout(binding = 1) uniform sampler1D sampler_meta;
-
-uniform vec2 resolution;
+#ifdef FONT_MONOSPACE
+uniform float column_width; // width of ' ' in pixels, the pitch of every column
+#endif
 
 out vec2 uv;
 out float color_index;
 
 void main(){
+#ifdef FONT_BATCH
+#ifdef FONT_PACKED_INSTANCES
+    int string_index = instancePacked.w & 0xFFFF;
+#else
+    int string_index = int(instanceTagged.w) >> 8;
+    vec4 instanceGlyph = vec4(instanceTagged.xyz, float(int(instanceTagged.w) & 0xFF));
+#endif
+    Font_String params = strings[string_index];
+    vec2 string_offset = params.offset_size.xy;
+    vec2 string_size = params.offset_size.zw;
+    vec2 resolution = params.resolution;
+#endif
+#ifdef FONT_PULL
+    int i = gl_InstanceID;
+    uint c = byte_at(i, false);
+
+    // control chars (newlines included) collapse to nothing
+    if (c < 32u || c >= 128u) {
+        gl_Position = vec4(0.0);
+        return;
+    }
+
+    // last line starting at or before i
+    int lo = 0;
+    int hi = num_lines - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1)/2;
+        if (line_starts[mid] <= i)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+
+#ifdef FONT_MONOSPACE
+    float x = float(i - line_starts[lo]);
+#else
+    float x = pull_x[i];
+#endif
+    float color = has_colors != 0 ? float(byte_at(i, true)) : 0.0;
+    vec4 instanceGlyph = vec4(x, -float(lo)*height, float(c - 32u), color);
+#elif defined(FONT_PACKED_INSTANCES)
+    vec4 instanceGlyph = vec4(instancePacked.xy, instancePacked.z & 0xFF, (instancePacked.z >> 8) & 0xFF);
+#endif
+
     float res_meta = textureSize(sampler_meta, 0);
     vec2 res_font = textureSize(sampler_font, 0);
 
@@ -39,12 +122,33 @@ void main(){
 
     // optimized/minimized
     float ratio_glyph = res_glyph.x/res_glyph.y;
-    vec2 p = string_offset + 2.0*string_size*(vertexPosition*vec2(ratio_glyph*res_font.x, res_font.y) + instanceGlyph.xy)/vec2(resolution.x, resolution.y);
+    vec2 glyph_size = vec2(ratio_glyph*res_font.x, res_font.y);
+#ifdef FONT_MONOSPACE
+    // instanceGlyph.xy is (column, row), columns are as wide as ' ' whatever this glyph's own width
+    vec2 glyph_xy = instanceGlyph.xy*vec2(column_width, glyph_size.y);
+#elif defined(FONT_PACKED_INSTANCES)
+    // instanceGlyph.y is the row, so a packed layout can be 32767 lines rather than 32767 px
+    vec2 glyph_xy = instanceGlyph.xy*vec2(1.0, glyph_size.y);
+#else
+    vec2 glyph_xy = instanceGlyph.xy;
+#endif
+    vec2 p = string_offset + 2.0*string_size*(vertexPosition*glyph_size + glyph_xy)/vec2(resolution.x, resolution.y);
     
     // send the correct uv's in the font atlas to the fragment shader
     uv = glyph_pos + vertexPosition*res_glyph;
     color_index = instanceGlyph.w;
 
+#ifdef FONT_BATCH
+    // a palette picked with markup replaces the string's palette
+    if (color_index < 9.0)
+        color_index += 9.0*float(params.palette);
+    gl_ClipDistance[0] = p.x - params.clip.x;
+    gl_ClipDistance[1] = p.y - params.clip.y;
+    gl_ClipDistance[2] = params.clip.z - p.x;
+    gl_ClipDistance[3] = params.clip.w - p.y;
+    gl_Position = vec4(p, params.z, 1.0);
+#else
     gl_Position = vec4(p, 0.0, 1.0);
+#endif
 }
 